@@ -8,45 +8,315 @@
   Copyright © 2024 DigiPen (USA) Corporation.    
 *****************************************************************************/
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
 #include "AudioData.h"
 
+    // Precomputed windowed sinc filters, one for every 1/256th of a sample. Computing a sinc per
+    // tap per sample is far too slow for live voices, a table lookup and a dot product isn't.
+    // Each row is 'taps' wide, covering the samples from (taps/2 - 1) before the phase to taps/2
+    // after it.
+class SincTable {
+public:
+    static constexpr unsigned phases = 256;
+
+        // Shared tables for 8, 16 or 32 taps, built on first use
+    static const SincTable& get(unsigned taps) {
+        static const SincTable table8(8), table16(16), table32(32);
+        return taps <= 8 ? table8 : (taps <= 16 ? table16 : table32);
+    }
+
+        // The filter for the nearest of the 256 phases to a 32 bit fraction
+    const float* row(uint32_t fraction) const {
+        return coefficients.data() + ((uint64_t(fraction) + (1u << 23)) >> 24) * taps;
+    }
+
+    const unsigned taps;
+
+private:
+    explicit SincTable(unsigned tapCount)
+        : taps(tapCount)
+        , coefficients((phases + 1) * tapCount)   // the extra row is a fraction of 1, for rounding up
+    {
+        const double pi = 3.14159265358979323846;
+        const double radius = taps / 2.0;
+
+            // A little under nyquist, so the short filters still have room to roll off
+        const double cutoff = 0.45;
+
+        for (unsigned p = 0; p <= phases; ++p) {
+            float* r = coefficients.data() + p * taps;
+            double sum = 0;
+
+            for (unsigned k = 0; k < taps; ++k) {
+                const double t = double(k) - (radius - 1) - double(p) / phases;
+                const double x = 2 * cutoff * t;
+                const double sinc = x == 0 ? 1 : std::sin(pi * x) / (pi * x);
+                const double window = 0.42 + 0.5 * std::cos(pi * t / radius) + 0.08 * std::cos(2 * pi * t / radius);
+
+                r[k] = float(sinc * window);
+                sum += r[k];
+            }
+
+                // Every phase passes DC at exactly unity gain
+            for (unsigned k = 0; k < taps; ++k)
+                r[k] = float(r[k] / sum);
+        }
+    }
+
+    std::vector<float> coefficients;
+};
+
 class Resample {
 public:
     explicit Resample(const AudioData *ad, unsigned channel,
                       float factor, unsigned loop_bgn, unsigned loop_end)
         ...
-    {}
+        , samples(ad->channel(channel))
+        , phase(0)
+        , increment(toFixed(factor))
+    {
+        pickLevel();
+    }
     
     float output() {
-        double index = findex;
+        const uint64_t at = phase >> level;
+        if (sinc)
+            return looping() || phase < uint64_t(audio_data->frames()) << 32 ? sincAt(at) : 0.f;
 
-        if (looping started)
-            index = keep between iloop_bgn and iloop_end;
+        unsigned floorIndex = unsigned(at >> 32);
 
         handle case where the index isnt valid
 
-        unsigned floorIndex = index;
-
-        float sample = audio_data->sample(floorIndex, ...);
-        float sample_next = audio_data->sample(floorIndex + 1, ...);
+        float sample = samples[floorIndex];
+        float sample_next = samples[floorIndex + 1];
 
         handle case where sample_next isnt valid
 
-        return lerp(between sample and sample_next using the decimal value of index);
+        return lerp(between sample and sample_next using fraction(at));
     }
 
-        // Move findex to next sample, taking into account the speedup and multiplier.
-    void next() { ... }
+        // Move the phase to the next sample, taking into account the speedup and multiplier.
+    void next() {
+        phase += increment;
+        if (looping() && phase >= loopEnd())
+            wrapLoop();
+    }
     
         // Would set the frequency multiplier using the value provided in units cents
-    void pitchOffset(float cents) { ... }
+    void pitchOffset(float cents) {
+        ...
+        increment = toFixed(double(speedup) * multiplier);
+        pickLevel();
+    }
     
-    void reset() { fIndex = 0; }
+    void reset() { phase = 0; }
+
+        // 0 (the default) interpolates linearly. 8, 16 or 32 switches to windowed sinc with that
+        // many taps, which costs more per sample but doesn't alias at large pitch offsets.
+    void setSincTaps(unsigned taps) { sinc = taps ? &SincTable::get(taps) : nullptr; }
+
+        // Renders 'frames' samples into 'out', the same as calling output() then next() that
+        // many times. Loop and end of data checks happen once per run instead of once per
+        // sample, and everything between them is interpolated 4 samples at a time (linear)
+        // or reads its taps straight from the channel (sinc).
+    void process(float* out, unsigned frames) {
+        if (samples.size() < 2) {
+            std::fill(out, out + frames, 0.f);
+            return;
+        }
+
+        const uint64_t end = looping() ? loopEnd() : uint64_t(audio_data->frames()) << 32;
+
+            // Outside of [fastBegin, fastEnd) some of the samples being read would be before the
+            // data, past the loop end or past the data. Sinc also needs contiguous samples. The
+            // phase counts level 0 samples, so the margins are scaled up to the level's. The loop
+            // end is rounded down to a whole sample of the level, the same way sincAt rounds it,
+            // so a run never reads a sample that sincAt would wrap.
+        const unsigned shift = 32 + level;
+        const uint64_t before = sinc ? sinc->taps / 2 - 1 : 0, after = sinc ? sinc->taps / 2 : 1;
+        const uint64_t lastSample = looping() ? std::min<uint64_t>(levelLoopEnd(), samples.size()) : samples.size();
+        const uint64_t limit = std::min<uint64_t>(end, lastSample << shift);
+        const uint64_t fastBegin = before << shift;
+        const uint64_t fastEnd = limit > (after << shift) && (!sinc || samples.contiguous()) ? limit - (after << shift) : 0;
+
+        while (frames) {
+            if (phase >= end) {
+                if (!looping()) {
+                    std::fill(out, out + frames, 0.f);
+                    return;
+                }
+
+                wrapLoop();
+            }
+
+                // How many samples until the slow edge, exact since it's all integers
+            unsigned run = 0;
+            if (phase >= fastBegin && phase < fastEnd)
+                run = increment ? unsigned(std::min<uint64_t>(frames, (fastEnd - phase + increment - 1) / increment)) : frames;
+
+            if (run) {
+                if (sinc)
+                    sincRun(out, run);
+                else
+                    lerpRun(out, run);
+                phase += run * increment;
+                out += run;
+                frames -= run;
+            }
+            else {
+                    // Right at an edge, where output() knows what the samples past it should be
+                *out++ = output();
+                next();
+                --frames;
+            }
+        }
+    }
 private:
+        // The phase is a 32.32 fixed point index: whole samples in the top half, the fraction
+        // in the bottom. Adding and wrapping it is exact, so a note can loop for as long as it's
+        // held without drifting, and renders the same on every platform.
+    static uint64_t toFixed(double index) { return uint64_t(index * 4294967296.0 + 0.5); }
+    static float fraction(uint64_t phase) { return float(uint32_t(phase) >> 8) * (1.f / (1 << 24)); }
+
+        // The mip level whose rate keeps the step at or under 1, so nothing past the level's
+        // nyquist gets skipped over (see AudioData::buildMips). The phase always counts level 0
+        // samples and gets shifted down to the level when it's read, so switching is seamless.
+    void pickLevel() {
+        level = 0;
+        while (level + 1 < audio_data->mipCount() && (increment >> level) > (uint64_t(1) << 32))
+            ++level;
+
+        samples = audio_data->channel(ichannel, level);
+    }
+
+    bool looping() const { return iloop_end > iloop_bgn; }
+    uint64_t loopEnd() const { return uint64_t(iloop_end) << 32; }
+
+        // The loop points in the current level's samples, rounded down
+    uint64_t levelLoopBgn() const { return iloop_bgn >> level; }
+    uint64_t levelLoopEnd() const { return iloop_end >> level; }
+
+    void wrapLoop() {
+        const uint64_t bgn = uint64_t(iloop_bgn) << 32;
+        phase = bgn + (phase - bgn) % (loopEnd() - bgn);
+    }
+
+        // Linear interpolation for 'count' samples from the current phase, all known to have
+        // a valid sample and sample_next.
+    void lerpRun(float* out, unsigned count) const {
+        const float* s = samples.samples;
+        const size_t stride = samples.stride;
+        unsigned i = 0;
+#ifdef AUDIO_SSE2
+            // Four phases in two registers. The fractions are the even 32 bit halves, so one
+            // shuffle pulls them out.
+        __m128i phase01 = _mm_set_epi64x(int64_t(phase + increment), int64_t(phase));
+        __m128i phase23 = _mm_set_epi64x(int64_t(phase + 3 * increment), int64_t(phase + 2 * increment));
+        const __m128i step = _mm_set1_epi64x(int64_t(4 * increment));
+        const __m128 fracScale = _mm_set1_ps(1.f / (1 << 24));
+        const __m128i levelShift = _mm_cvtsi32_si128(int(level));
+        const unsigned shift = 32 + level;
+
+        for (; i + 4 <= count; i += 4) {
+                // The top 24 bits of the fraction are all a float keeps anyway
+            const __m128i at01 = _mm_srl_epi64(phase01, levelShift), at23 = _mm_srl_epi64(phase23, levelShift);
+            const __m128i fracBits = _mm_srli_epi32(_mm_castps_si128(_mm_shuffle_ps(
+                _mm_castsi128_ps(at01), _mm_castsi128_ps(at23), _MM_SHUFFLE(2, 0, 2, 0))), 8);
+            const __m128 frac = _mm_mul_ps(_mm_cvtepi32_ps(fracBits), fracScale);
+
+                // No gathers in SSE2, so the samples are loaded one by one. The whole parts are
+                // taken from the scalar phase, going through memory to get them out of the
+                // registers above costs more than the shifts.
+            const uint64_t at = phase + i * increment;
+            const float* s0 = s + size_t(at >> shift) * stride;
+            const float* s1 = s + size_t((at + increment) >> shift) * stride;
+            const float* s2 = s + size_t((at + 2 * increment) >> shift) * stride;
+            const float* s3 = s + size_t((at + 3 * increment) >> shift) * stride;
+
+            const __m128 va = _mm_setr_ps(s0[0], s1[0], s2[0], s3[0]);
+            const __m128 vb = _mm_setr_ps(s0[stride], s1[stride], s2[stride], s3[stride]);
+            _mm_storeu_ps(out + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), frac)));
+
+            phase01 = _mm_add_epi64(phase01, step);
+            phase23 = _mm_add_epi64(phase23, step);
+        }
+#endif
+        for (; i < count; ++i) {
+            const uint64_t at = (phase + i * increment) >> level;
+            const float* sample = s + size_t(at >> 32) * stride;
+            out[i] = sample[0] + (sample[stride] - sample[0]) * fraction(at);
+        }
+    }
+
+        // Sinc for 'count' samples from the current phase, all with their taps inside the channel
+        // and before the loop end.
+    void sincRun(float* out, unsigned count) const {
+        const unsigned taps = sinc->taps;
+        const size_t before = taps / 2 - 1;
+        uint64_t at = phase;
+
+            // The run starts at least 'before' samples in, so the first tap is never before the data
+        for (unsigned i = 0; i < count; ++i, at += increment) {
+            const uint64_t levelAt = at >> level;
+            out[i] = dot(samples.samples + (size_t(levelAt >> 32) - before), sinc->row(uint32_t(levelAt)), taps);
+        }
+    }
+
+        // Sinc anywhere, 'at' being a phase in the level's samples. Taps past the loop end wrap
+        // back around to the loop beginning, and taps outside the data are silent.
+    float sincAt(uint64_t at) const {
+        const unsigned taps = sinc->taps;
+        const int64_t first = int64_t(at >> 32) - (taps / 2 - 1);
+        const int64_t loopBgn = int64_t(levelLoopBgn()), loopEnd = int64_t(levelLoopEnd());
+        float window[32];
+
+        for (unsigned k = 0; k < taps; ++k) {
+            int64_t index = first + k;
+            if (loopEnd > loopBgn && index >= loopEnd)
+                index = loopBgn + (index - loopEnd) % (loopEnd - loopBgn);
+
+            window[k] = index >= 0 && uint64_t(index) < samples.size() ? samples[size_t(index)] : 0.f;
+        }
+
+        return dot(window, sinc->row(uint32_t(at)), taps);
+    }
+
+        // 'taps' is always a multiple of 8
+    static float dot(const float* x, const float* h, unsigned taps) {
+#ifdef AUDIO_SSE2
+        __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+        for (unsigned k = 0; k < taps; k += 8) {
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + k), _mm_loadu_ps(h + k)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + k + 4), _mm_loadu_ps(h + k + 4)));
+        }
+
+        __m128 sum = _mm_add_ps(acc0, acc1);
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+        return _mm_cvtss_f32(sum);
+#else
+        float sum = 0;
+        for (unsigned k = 0; k < taps; ++k)
+            sum += x[k] * h[k];
+        return sum;
+#endif
+    }
+
     const AudioData *audio_data;
     unsigned ichannel;
-    double findex;
+        // The channel being played. Contiguous when audio_data is planar.
+    ChannelView samples;
+    uint64_t phase,
+             increment;     // speedup * multiplier, in 32.32
     float speedup,
           multiplier;
     unsigned iloop_bgn, iloop_end;
+        // Only set in sinc mode
+    const SincTable* sinc = nullptr;
+        // Mip level 'samples' is from
+    unsigned level = 0;
 };
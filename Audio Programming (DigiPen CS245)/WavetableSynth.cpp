@@ -7,8 +7,10 @@
   Copyright © 2024 DigiPen (USA) Corporation.    
 *****************************************************************************/
 
+#include <algorithm>
 #include <array>
-#include <mutex> //<-- each function in WavetableSynth locks a mutex, not shown
+#include <atomic>
+#include <chrono>
 
 #include "MidiIn.h"
 #include "AudioData.h"
@@ -26,6 +28,14 @@ class ADSR {
     void next() { ... }
     void output() { ... }
 
+        // The next 'frames' values of the curve
+    void process(float* out, unsigned frames) {
+        for (unsigned i = 0; i < frames; ++i) {
+            out[i] = output();
+            next();
+        }
+    }
+
     ...
 };
 
@@ -39,49 +49,196 @@ namespace {
     constexpr int fileLoopBegin = ..., fileLoopEnd = ...;
   
     constexpr double vibratoRate = ...;
+
+    // Samples between modulation (pitch wheel, vibrato) updates. Vibrato is a few hertz, so
+    // updating it ~700 times a second instead of 44100 can't be heard.
+    constexpr unsigned controlRate = 64;
+
+    // MIDI events that can be waiting for the audio thread at once. A keyboard can't get
+    // anywhere near this many into one block.
+    constexpr unsigned eventCapacity = 256;
+
+    // Taps of windowed sinc each note resamples with, 0 for linear interpolation.
+    // 16 taps on every note at once is still only a couple percent of a core.
+    constexpr unsigned resampleTaps = 16;
+
+    // Octaves of band limited copies built when the file's loaded, so notes up to this many
+    // octaves above the sample read at about their own rate.
+    constexpr unsigned mipLevels = 6;
     
     constexpr double twopi = 6.28318530718;
 }
 
+// Wait-free single producer, single consumer queue. One thread pushes, another pops, and
+// neither ever locks, blocks or allocates.
+template <typename T, unsigned Capacity>
+class SpscRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity has to be a power of two");
+
+public:
+    // Producer only. Returns false (and drops 'item') if the ring is full.
+    bool push(const T& item) {
+        const unsigned tail = write.load(std::memory_order_relaxed);
+        if (tail - read.load(std::memory_order_acquire) == Capacity)
+            return false;
+
+        items[tail & (Capacity - 1)] = item;
+        write.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false if there was nothing to pop.
+    bool pop(T& item) {
+        const unsigned head = read.load(std::memory_order_relaxed);
+        if (head == write.load(std::memory_order_acquire))
+            return false;
+
+        item = items[head & (Capacity - 1)];
+        read.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::array<T, Capacity> items{};
+
+    // Each on its own cache line, so the two threads aren't fighting over one
+    alignas(64) std::atomic<unsigned> write{ 0 };
+    alignas(64) std::atomic<unsigned> read{ 0 };
+};
+
 class WavetableSynth : private MidiIn {
 public:
-    WavetableSynth(int devno, int R) { ... }
+        // Each note plays a single channel, so the samples are kept planar for contiguous reads.
+        // The sinc table is built here so the audio thread doesn't build it on the first note.
+    WavetableSynth(int devno, int R) : ad(file, AudioData::Layout::planar, mipLevels), ... {
+        SincTable::get(resampleTaps);
+        ...
+    }
     ~WavetableSynth() { ... }
 
-    void next() {
-        for each active note:
-            call next() on respective members
-        
-        increment sampleTime
-        handle floating point precision errors
-    }
+        // Renders the next 'frames' samples into 'out'. Replaces calling output() and next()
+        // every sample: modulation is updated once every controlRate samples, and each note
+        // renders a whole slice at a time. Nothing in here locks, MIDI events come in through
+        // the event ring and get applied at the sample they line up with.
+    void render(float* out, unsigned frames) {
+        if (!frames)
+            return;
 
-    void output() {
-        UpdateMultipliers();
+        const Clock::time_point blockTime = Clock::now();
+        const unsigned eventCount = drainEvents(blockTime, frames);
+        unsigned nextEvent = 0;
 
-        double finalOutput = 0;
+        std::fill(out, out + frames, 0.f);
 
-        for each active note:
-            finalOutput += (some multiplier) * (note info -- sample values, any adsr curve, etc);
-        
-        return volume * finalOutput;
+        for (unsigned done = 0; done < frames;) {
+            while (nextEvent < eventCount && pending[nextEvent].offset <= done)
+                applyEvent(pending[nextEvent++].event);
+
+                // Slices end on control rate boundaries, so modulation lands on the same samples
+                // no matter how big the blocks are, and they also end at the next event
+            unsigned count = std::min(frames - done, controlRate - unsigned(sampleTime % controlRate));
+            if (nextEvent < eventCount)
+                count = std::min(count, pending[nextEvent].offset - done);
+
+            UpdateMultipliers();
+            const float gain = float(volume);
+
+            for each active note:
+                note.resample.process(voiceBuffer.data(), count);
+                note.adsr.process(envelopeBuffer.data(), count);
+
+                for (unsigned i = 0; i < count; ++i)
+                    out[done + i] += gain * (some multiplier) * voiceBuffer[i] * envelopeBuffer[i];
+
+            advance sampleTime by count
+            handle floating point precision errors
+
+            done += count;
+        }
+
+        lastBlockTime = blockTime;
     }
 
 private:
     // Held data that every note needs to have like amplitude, etc.
     struct Note {
         ...
+        Resample resample { ... };
         ADSR adsr { ... };
         ...
     };
 
-       //MidiIn implementations
+    using Clock = std::chrono::steady_clock;
+
+    // A MIDI callback, saved for the audio thread to apply
+    struct MidiEvent {
+        enum Type : uint8_t { noteOn, noteOff, pitchWheel, volumeChange, modulation };
+
+        Type type;
+        int note, value;        // value is the velocity, volume level or modulation amount
+        float pitchWheel;
+        Clock::time_point time;
+    };
+
+        //MidiIn implementations. These run on the MIDI thread, so all they do is queue the
+        //event for render. A full ring drops the event rather than wait.
     void onNoteOn(int channel, int noteIndex, int velocity) override {
+        events.push(MidiEvent{ MidiEvent::noteOn, noteIndex, velocity, 0.f, Clock::now() });
+    }
+
+    void onNoteOff(int channel, int noteIndex) override {
+        events.push(MidiEvent{ MidiEvent::noteOff, noteIndex, 0, 0.f, Clock::now() });
+    }
+
+    void onPitchWheelChange(int channel, float value) override {
+        events.push(MidiEvent{ MidiEvent::pitchWheel, 0, 0, value, Clock::now() });
+    }
+
+    void onVolumeChange(int channel, int level) override {
+        events.push(MidiEvent{ MidiEvent::volumeChange, 0, level, 0.f, Clock::now() });
+    }
+
+    void onModulationWheelChange(int channel, int value) override {
+        events.push(MidiEvent{ MidiEvent::modulation, 0, value, 0.f, Clock::now() });
+    }
+
+        //Pops everything the MIDI thread queued into 'pending' with the sample it lands on.
+        //An event's offset is how long after the last block started it came in, so every event
+        //plays exactly one block late instead of being snapped to the start of a block.
+    unsigned drainEvents(Clock::time_point blockTime, unsigned frames) {
+        unsigned count = 0;
+        MidiEvent event;
+
+        while (count < eventCapacity && events.pop(event)) {
+            const double seconds = std::chrono::duration<double>(event.time - lastBlockTime).count();
+            const double offset = lastBlockTime == Clock::time_point{} ? 0.0 : seconds * samplingRate;
+
+            const unsigned clamped = offset <= 0 ? 0u : unsigned(std::min<double>(offset, frames - 1));
+
+                // Events come out in the order they went in, so offsets never go backwards
+            pending[count].offset = count ? std::max(clamped, pending[count - 1].offset) : clamped;
+            pending[count].event = event;
+            ++count;
+        }
+
+        return count;
+    }
+
+    void applyEvent(const MidiEvent& event) {
+        switch (event.type) {
+        case MidiEvent::noteOn:       startNote(event.note, event.value); break;
+        case MidiEvent::noteOff:      stopNote(event.note); break;
+        case MidiEvent::pitchWheel:   adjust pitchWheelOffset using event.pitchWheel; break;
+        case MidiEvent::volumeChange: adjust volume using event.value; break;
+        case MidiEvent::modulation:   adjust vibratoDepth using event.value; break;
+        }
+    }
+
+    void startNote(int noteIndex, int velocity) {
         float freqOffset = ...;
 
         Note newNote { ... };
-
-        lock mutex here instead of at top of function
+        newNote.resample.setSincTaps(resampleTaps);
 
         if (activatedNotes != maxNotes) {
             set an open/finished note to this note
@@ -93,7 +250,7 @@ private:
         }
     }
 
-    void onNoteOff(int channel, int noteIndex) override {
+    void stopNote(int noteIndex) {
         make sure note is in the "notes" list.
 
         if it is in the list:
@@ -103,11 +260,7 @@ private:
         update all notes activation orders
     }
 
-    void onPitchWheelChange(int channel, float value) override { adjust pitchWheelOffset }
-    void onVolumeChange(int channel, int level) override { adjust volume }
-    void onModulationWheelChange(int channel, int value) override { adjust vibratoDepth }
-
-        //updates pitch offset and vibrato offset
+        //updates pitch offset and vibrato offset, called once per control rate slice
     void UpdateMultipliers() {
         float vibratoOffset = ...;
 
@@ -115,7 +268,20 @@ private:
     }
 
     std::array<Note, maxNotes> notes{};
-    std::mutex noteMutex{}; <-- each function locks the mutex, not shown
+
+        //per note scratch space for render, a slice is never longer than controlRate
+    std::array<float, controlRate> voiceBuffer{}, envelopeBuffer{};
+
+        //MIDI thread -> audio thread. Only ever touched by render (and what it calls) on the
+        //audio side, so none of the note data needs a lock.
+    SpscRing<MidiEvent, eventCapacity> events;
+
+    struct PendingEvent {
+        MidiEvent event;
+        unsigned offset;
+    };
+    std::array<PendingEvent, eventCapacity> pending{};
+    Clock::time_point lastBlockTime{};
   
     AudioData ad;
   
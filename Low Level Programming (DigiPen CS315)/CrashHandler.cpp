@@ -1,18 +1,18 @@
 /*****************************************************************************
-  Crash Handler Program for Windows
+  Crash Handler Program for Windows and Linux
 	Some details redacted to prevent future students in this class from seeing
 	this code and using it to cheat in the class.
 
+	Windows writes a minidump. Linux writes a compact dump of its own (see the
+	Linux implementation for the layout) from a signal handler, which is a lot
+	faster than waiting on a full core dump. Either can be written by a helper
+	process instead of the one that crashed.
+
   Author(s): Evan O'Bryant
   Copyright © 2023 DigiPen (USA) Corporation.    
 *****************************************************************************/
 
-#define WIN32_LEAN_AND_MEAN
-#include <Windows.h>
-
-// Links dbghelp library without messing with the visual studio project files.
-#pragma comment(lib, "dbghelp.lib")
-#include <DbgHelp.h>
+#include <cstdint>
 
 namespace MiniCrashHandler {
 		// A list of different dump modes to output, depending on how much info you want
@@ -23,30 +23,254 @@ namespace MiniCrashHandler {
 		DUMP_MASSIVE	//MiniDumpNormal | MiniDumpWithDataSegs | MiniDumpWithCodeSegs | MiniDumpWithIndirectlyReferencedMemory | MiniDumpWithUnloadedModules | MiniDumpWithFullMemory
 	};
 
+		// Where the dump gets written from
+	enum class DumpMode : char {
+		IN_PROCESS,	// By the crashing process itself
+		HELPER			// By a helper process started in Init. The crashing process only has to tell it
+						// to start and wait, so dumps still work with a corrupted heap or no stack left.
+	};
+
+		// Initialize the crash dump handler. Dumps are written to 'dumpDir'.
+	void Init(DumpType dS = DumpType::DUMP_SMALL, const char* dumpDir = ".", DumpMode mode = DumpMode::IN_PROCESS);
+
+		// The Windows helper is this program started again with extra arguments. Call this first
+		// thing in main; if it returns true this process was the helper and main should return.
+		// Always false on Linux, where the helper is forked instead.
+	bool RunHelper(int argc, char** argv);
+
+		// Gives the calling thread its own stack to handle a crash on, so a stack overflow
+		// can still be dumped. Init already does this for the thread that calls it.
+	void InitThread();
+
+		// Caps the size of DUMP_BIG and DUMP_MASSIVE dumps. Memory is kept most important first
+		// (stacks, then around the fault and whatever the registers point at, then the rest)
+		// until the budget runs out. 0 means no limit.
+	void SetDumpBudget(uint64_t bytes);
+} // namespace MiniCrashHandler
+
+
+// ----- Windows Implementation -----
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+// Links dbghelp library without messing with the visual studio project files.
+#pragma comment(lib, "dbghelp.lib")
+#include <DbgHelp.h>
+#include <cstring>
+#include <iterator>
+#include <string>
+
+namespace MiniCrashHandler {
 		// Stores minidump flags to be used in the event of a crash
 	static MINIDUMP_TYPE dumpInfo = MiniDumpNormal;
+	static ULONG dumpStackSize = 0;
+	static ULONG64 dumpBudget = 0;
 
-		// The exception filter function that will create the minidump file upon a crash
-	LONG WINAPI ExceptionLogger(EXCEPTION_POINTERS* e) {
+		// Helper mode. The crashing thread writes a request into the pipe and waits on the event,
+		// which the helper sets once the dump is written.
+	struct HelperRequest {
+		DWORD threadId;
+		EXCEPTION_POINTERS* exception;
+		ULONG64 budget;
+	};
+	static HANDLE helperPipe = nullptr;
+	static HANDLE helperDone = nullptr;
+	static constexpr DWORD helperTimeoutMs = 30'000;
+	static constexpr char helperArg[] = "--minicrash-helper";
+
+		// Memory ranges handed to MiniDumpWriteDump when a full memory dump has a budget, most
+		// important first. Static so nothing is allocated while crashing.
+	struct MemoryPlan {
+		struct Range {
+			ULONG64 base;
+			ULONG size;
+		};
+
+		Range ranges[4096];
+		size_t count = 0, next = 0;
+		ULONG64 total = 0;
+	};
+	static MemoryPlan plan;
+		// Around the fault address, and around whatever a register points at
+	static constexpr ULONG64 faultWindow = 64 * 1024, registerWindow = 8 * 1024;
+		// Big regions go in as several ranges, MINIDUMP_CALLBACK_OUTPUT only takes a ULONG size
+	static constexpr ULONG64 maxRangeSize = 16 * 1024 * 1024;
+
+	static bool PlanRange(ULONG64 base, ULONG64 size) {
+		for (ULONG64 offset = 0; offset < size; offset += maxRangeSize) {
+			const ULONG64 piece = min(size - offset, maxRangeSize);
+			if (plan.count == std::size(plan.ranges) || plan.total + piece > dumpBudget)
+				return false;
+
+			plan.ranges[plan.count++] = { base + offset, static_cast<ULONG>(piece) };
+			plan.total += piece;
+		}
+
+		return true;
+	}
+
+	static void PlanAround(HANDLE process, ULONG64 addr, ULONG64 window) {
+		MEMORY_BASIC_INFORMATION info;
+		if (!VirtualQueryEx(process, reinterpret_cast<void*>(addr), &info, sizeof(info)) || info.State != MEM_COMMIT)
+			return;
+
+		const auto begin = reinterpret_cast<ULONG64>(info.BaseAddress);
+		const ULONG64 end = begin + info.RegionSize;
+		const ULONG64 first = addr - begin > window ? addr - window : begin;
+		const ULONG64 last = end - addr > window ? addr + window : end;
+		PlanRange(first, last - first);
+	}
+
+		// Stacks are always in a minidump. After them comes memory around the fault and the
+		// registers, then writable private memory. Image and mapped file sections are skipped,
+		// they can be loaded from the files.
+	static void PlanMemory(HANDLE process, const EXCEPTION_RECORD& record, const CONTEXT& c) {
+		plan.count = plan.next = 0;
+		plan.total = 0;
+
+		const bool accessViolation = record.ExceptionCode == EXCEPTION_ACCESS_VIOLATION && record.NumberParameters >= 2;
+		PlanAround(process, accessViolation ? record.ExceptionInformation[1] : reinterpret_cast<ULONG64>(record.ExceptionAddress), faultWindow);
+
+		for (DWORD64 value : { c.Rax, c.Rbx, c.Rcx, c.Rdx, c.Rsi, c.Rdi, c.Rbp, c.R8, c.R9, c.R10, c.R11, c.R12, c.R13, c.R14, c.R15 })
+			PlanAround(process, value, registerWindow);
+
+		MEMORY_BASIC_INFORMATION info;
+		for (char* addr = nullptr; VirtualQueryEx(process, addr, &info, sizeof(info)); addr += info.RegionSize) {
+			const DWORD writable = PAGE_READWRITE | PAGE_WRITECOPY | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY;
+			if (info.State != MEM_COMMIT || info.Type != MEM_PRIVATE || !(info.Protect & writable) || (info.Protect & PAGE_GUARD))
+				continue;
+
+			if (!PlanRange(reinterpret_cast<ULONG64>(info.BaseAddress), info.RegionSize))
+				break;
+		}
+	}
+
+		// Hands the planned ranges to MiniDumpWriteDump one at a time
+	static BOOL CALLBACK PlanCallback(PVOID, const PMINIDUMP_CALLBACK_INPUT input, PMINIDUMP_CALLBACK_OUTPUT output) {
+		if (input->CallbackType != MemoryCallback)
+			return TRUE;
+		if (plan.next == plan.count)
+			return FALSE;
+
+		output->MemoryBase = plan.ranges[plan.next].base;
+		output->MemorySize = plan.ranges[plan.next].size;
+		++plan.next;
+		return TRUE;
+	}
+
+		// Writes the dump of 'process'. 'clientPointers' is set when 'e' points into that process
+		// instead of this one, which is the case for the helper.
+	static void WriteDump(HANDLE process, DWORD processID, DWORD threadId, EXCEPTION_POINTERS* e, BOOL clientPointers,
+		const EXCEPTION_RECORD& record, const CONTEXT& context)
+	{
 			// Get variables needed to produce the minidump
-		HANDLE process = ...;
-		DWORD processID = ...;
 		HANDLE dumpFile = ...;
-		MINIDUMP_EXCEPTION_INFORMATION mei = ... ;
-		
+		MINIDUMP_EXCEPTION_INFORMATION mei{ threadId, e, clientPointers };
+
+			// With a budget, full memory is swapped for the planned ranges. MiniDumpWriteDump can't
+			// compress as it goes, so only the Linux dump is compressed.
+		MINIDUMP_TYPE type = dumpInfo;
+		MINIDUMP_CALLBACK_INFORMATION callback{ PlanCallback, nullptr };
+		const bool budgeted = dumpBudget != 0 && (dumpInfo & MiniDumpWithFullMemory);
+		if (budgeted) {
+			PlanMemory(process, record, context);
+			type = static_cast<MINIDUMP_TYPE>(dumpInfo & ~MiniDumpWithFullMemory);
+		}
+
 			// Create the dump and close the non-pseudo handle (the file handle)
-		MiniDumpWriteDump(process, processID, dumpFile, dumpInfo, &mei, nullptr, nullptr);
+		MiniDumpWriteDump(process, processID, dumpFile, type, &mei, nullptr, budgeted ? &callback : nullptr);
 		CloseHandle(dumpFile);
+	}
+
+		// The exception filter function that will create the minidump file upon a crash
+	LONG WINAPI ExceptionLogger(EXCEPTION_POINTERS* e) {
+			// With a helper all this thread does is hand over and wait, which takes next to no stack
+		if (helperPipe) {
+			const HelperRequest request{ GetCurrentThreadId(), e, dumpBudget };
+			DWORD written = 0;
+
+			if (WriteFile(helperPipe, &request, sizeof(request), &written, nullptr) && written == sizeof(request)) {
+				WaitForSingleObject(helperDone, helperTimeoutMs);
+				return EXCEPTION_CONTINUE_SEARCH;
+			}
+		}
+
+		WriteDump(GetCurrentProcess(), GetCurrentProcessId(), GetCurrentThreadId(), e, FALSE, *e->ExceptionRecord, *e->ContextRecord);
 
 			// Continue crashing
 		return EXCEPTION_CONTINUE_SEARCH;
 	}
 
+		// Starts this program again as the helper. It inherits the read end of the pipe, the event,
+		// and a handle to this process.
+	static bool StartHelper(const char* dumpDir) {
+		SECURITY_ATTRIBUTES inheritable{ sizeof(inheritable), nullptr, TRUE };
+		HANDLE pipeRead = nullptr, self = nullptr;
+
+		if (!CreatePipe(&pipeRead, &helperPipe, &inheritable, sizeof(HelperRequest)))
+			return false;
+		SetHandleInformation(helperPipe, HANDLE_FLAG_INHERIT, 0);
+
+		helperDone = CreateEventA(&inheritable, FALSE, FALSE, nullptr);
+		DuplicateHandle(GetCurrentProcess(), GetCurrentProcess(), GetCurrentProcess(), &self,
+			PROCESS_ALL_ACCESS, TRUE, 0);
+
+			// "<this exe> --minicrash-helper <pipe> <event> <process> <dump type> <dumpDir>"
+		std::string command = ...;
+		STARTUPINFOA startup{ sizeof(startup) };
+		PROCESS_INFORMATION info;
+		const bool started = CreateProcessA(nullptr, command.data(), nullptr, nullptr, TRUE,
+			CREATE_NO_WINDOW, nullptr, nullptr, &startup, &info);
+
+			// The helper holds its own copies now
+		CloseHandle(pipeRead);
+		CloseHandle(self);
+		if (!started) {
+			CloseHandle(helperPipe);
+			helperPipe = nullptr;
+			return false;
+		}
+
+		CloseHandle(info.hThread);
+		CloseHandle(info.hProcess);
+		return true;
+	}
+
+	bool RunHelper(int argc, char** argv) {
+		if (argc < 2 || std::strcmp(argv[1], helperArg) != 0)
+			return false;
+
+			// Handles, dump type and directory from the command line
+		HANDLE pipeRead = ..., process = ...;
+		helperDone = ...;
+		dumpInfo = ...;
+
+			// The pipe breaks when the program exits without crashing
+		HelperRequest request;
+		DWORD got = 0;
+		if (!ReadFile(pipeRead, &request, sizeof(request), &got, nullptr) || got != sizeof(request))
+			return true;
+
+		dumpBudget = request.budget;
+
+			// The budget plan needs the exception and context, which live in the crashed process
+		EXCEPTION_POINTERS pointers{};
+		EXCEPTION_RECORD record{};
+		CONTEXT context{};
+		ReadProcessMemory(process, request.exception, &pointers, sizeof(pointers), nullptr);
+		ReadProcessMemory(process, pointers.ExceptionRecord, &record, sizeof(record), nullptr);
+		ReadProcessMemory(process, pointers.ContextRecord, &context, sizeof(context), nullptr);
+
+		WriteDump(process, GetProcessId(process), request.threadId, request.exception, TRUE, record, context);
+		SetEvent(helperDone);
+		return true;
+	}
+
 		// Initialize the crash dump handler
-	void Init(DumpType dS = DumpType::DUMP_SMALL) {
+	void Init(DumpType dS, const char* dumpDir, DumpMode mode) {
 			// Set the minidump creation function as the crash handler
 		SetUnhandledExceptionFilter(ExceptionLogger);
-	
+
 			// Set dump info flags based on the provided dump type.
 			// Also gets the size that the stack should guarantee will be available to the
 			// exception filter function.
@@ -57,9 +281,899 @@ namespace MiniCrashHandler {
 			break;
 		}
 
+			// The helper does the work, so crashing threads don't need extra stack reserved
+		if (mode == DumpMode::HELPER && StartHelper(dumpDir))
+			return;
+
+		InitThread();
+	}
+
+	void InitThread() {
+		if (helperPipe)
+			return;
+
 			// Reserve a certain amount of memory on the stack. Prevents issues when dumping
 			// during something like a stack overflow.
-		SetThreadStackGuarantee(&dumpStackSize);
+		ULONG size = dumpStackSize;
+		SetThreadStackGuarantee(&size);
+	}
+
+	void SetDumpBudget(uint64_t bytes) {
+		dumpBudget = bytes;
+	}
+
+} // namespace MiniCrashHandler
+
+
+// ----- Linux Implementation -----
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+	// Dump layout, all little endian:
+	//	header:  "SCRD" u16 version, u16 arch (1 = x86_64), i32 signal, i32 si_code,
+	//	         u64 fault address, u32 pid, u32 crashing tid
+	//	records: u32 kind, u32 tid, u64 payload size, payload
+	//	         Registers - the thread's gregset_t
+	//	         Stack     - u64 address of the first byte, then the bytes up to the top of the stack
+	//	         Maps      - /proc/self/maps as text
+	//	         Memory    - u64 address, u32 size, u32 compressed size (0 if stored as is), then
+	//	                     the bytes as an LZ4 block. DUMP_PARTIAL and up, added in version 2.
+	//	         End       - no payload, only there if the dump finished
+	//	The crashing thread's records come first, memory comes last, most important first.
+namespace MiniCrashHandler {
+	enum class RecordKind : uint32_t { End, Registers, Stack, Maps, Memory };
+
+	struct FileHeader {
+		char magic[4] = { 'S', 'C', 'R', 'D' };
+		uint16_t version = 2;
+		uint16_t arch = 1;
+		int32_t signal = 0;
+		int32_t code = 0;
+		uint64_t faultAddr = 0;
+		uint32_t pid = 0;
+		uint32_t crashTid = 0;
+	};
+
+	struct RecordHeader {
+		RecordKind kind;
+		uint32_t tid;
+		uint64_t size;
+	};
+
+	struct MemoryHeader {
+		uint64_t address;
+		uint32_t size;
+		uint32_t compressedSize;
+	};
+
+	struct Range {
+		uintptr_t begin, end;
+	};
+
+		// Everything the dump needs from the crashing thread. In helper mode this is what gets sent over.
+	struct CrashInfo {
+		int32_t signal;
+		int32_t code;
+		uint64_t faultAddr;
+		uint64_t budget;
+		pid_t pid;
+		pid_t tid;
+		gregset_t regs;
+	};
+
+		// One line of /proc/self/maps
+	struct Mapping {
+		uintptr_t begin = 0, end = 0;
+		bool readable = false, writable = false, shared = false, fileBacked = false;
+	};
+
+		// Everything the handler touches is set up in Init. Nothing in the handler allocates,
+		// locks or calls anything that isn't async-signal-safe.
+	static constexpr int fatalSignals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+	static struct sigaction oldActions[std::size(fatalSignals)];
+		// Sent to every other thread to grab its registers. Profiler.cpp uses SIGRTMIN + 1.
+	static const int captureSignal = SIGRTMIN + 3;
+
+	static constexpr size_t altStackSize = 64 * 1024;
+		// Stacks bigger than this only keep the part closest to the stack pointer
+	static constexpr size_t maxStackBytes = 256 * 1024;
+		// Below the stack pointer that leaf functions are still allowed to use
+	static constexpr size_t redZone = 128;
+		// How long a thread gets to answer captureSignal before it's skipped
+	static constexpr long captureTimeoutNs = 50'000'000;
+	static constexpr size_t maxThreads = 512;
+
+	static constexpr uintptr_t pageSize = 4096;
+		// Memory is read, compressed and written this much at a time
+	static constexpr size_t memoryBlockSize = 64 * 1024;
+		// Around the fault address, and around whatever a register points at
+	static constexpr uintptr_t faultWindow = 64 * 1024, registerWindow = 8 * 1024;
+	static constexpr size_t maxRanges = 8192;
+	static constexpr int hashBits = 12;
+
+		// Every dump type writes registers, stacks and maps. DUMP_PARTIAL adds memory around the fault
+		// and the registers, DUMP_BIG all writable memory, DUMP_MASSIVE every page that's been changed.
+	static DumpType dumpType = DumpType::DUMP_SMALL;
+	static uint64_t dumpBudget = 0;
+	static uint64_t bytesWritten = 0;
+		// Unnamed file in the dump directory that gets linked into place once the dump is written.
+		// -1 if the filesystem doesn't support O_TMPFILE, then the file is created on a crash.
+	static int dumpFd = -1;
+	static int dumpDirFd = -1;
+	static int mapsFd = -1;
+	static int taskFd = -1;
+	static int pagemapFd = -1;
+	static char mapsBuffer[512 * 1024];
+	static size_t mapsSize = 0;
+	static char direntBuffer[4096];
+
+		// Registers of every thread written so far, for finding memory they point at
+	static gregset_t threadRegs[maxThreads];
+	static size_t threadCount = 0;
+		// Memory already in the dump, so the bulk pass doesn't write it twice
+	static Range written[maxRanges];
+	static size_t writtenCount = 0;
+	static Range nearby[maxRanges];
+	static size_t nearbyCount = 0;
+
+	static uint8_t readBuffer[memoryBlockSize];
+	static uint8_t compressBuffer[memoryBlockSize + memoryBlockSize / 255 + 16];
+	static uint32_t hashTable[1 << hashBits];
+	static uint64_t pagemapBuffer[512];
+	static uintptr_t pagemapFirst = 0, pagemapCount = 0;
+
+	static std::atomic_bool crashing = false;
+
+		// Helper mode. The helper is forked in Init, so it starts with all of the fds and buffers
+		// above. Threads are stopped with ptrace and memory is read with process_vm_readv, which
+		// works the same from either process.
+	static int helperSocket = -1;
+	static bool inHelper = false;
+	static constexpr int helperTimeoutMs = 30'000;
+		// How often an idle helper checks that the process it's watching is still there
+	static constexpr int parentCheckMs = 1'000;
+	static pid_t traced[maxThreads];
+	static size_t tracedCount = 0;
+
+		// Handshake with the thread being captured
+	struct ThreadCapture {
+		std::atomic<pid_t> target = 0;
+		std::atomic_bool captured = false;
+		gregset_t regs;
+	};
+	static ThreadCapture capture;
+
+		// Alternate signal stack for one thread. Freed when the thread exits.
+	struct AltStack {
+		void* memory = nullptr;
+
+		~AltStack() {
+			if (!memory)
+				return;
+
+			stack_t disable{};
+			disable.ss_flags = SS_DISABLE;
+			sigaltstack(&disable, nullptr);
+			munmap(memory, altStackSize);
+		}
+	};
+	static thread_local AltStack altStack;
+
+	static pid_t GetTid() {
+		return static_cast<pid_t>(syscall(SYS_gettid));
+	}
+
+	static uint64_t MonotonicNs() {
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return static_cast<uint64_t>(now.tv_sec) * 1'000'000'000 + now.tv_nsec;
+	}
+
+		// write() that finishes partial writes
+	static bool WriteAll(int fd, const void* buffer, size_t size) {
+		const char* bytes = static_cast<const char*>(buffer);
+
+		while (size > 0) {
+			const ssize_t written = write(fd, bytes, size);
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0)
+				return false;
+
+			bytes += written;
+			size -= static_cast<size_t>(written);
+			bytesWritten += static_cast<uint64_t>(written);
+		}
+
+		return true;
+	}
+
+	static void WriteRecord(int fd, RecordKind kind, pid_t tid, const void* payload, size_t size) {
+		const RecordHeader header{ kind, static_cast<uint32_t>(tid), size };
+		WriteAll(fd, &header, sizeof(header));
+		WriteAll(fd, payload, size);
+	}
+
+		// Reads a whole file into 'out' from the start. Returns the size read.
+	static size_t ReadFromStart(int fd, char* out, size_t capacity) {
+		if (lseek(fd, 0, SEEK_SET) != 0)
+			return 0;
+
+		size_t size = 0;
+		while (size < capacity) {
+			const ssize_t got = read(fd, out + size, capacity - size);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+				break;
+
+			size += static_cast<size_t>(got);
+		}
+
+		return size;
+	}
+
+	static uintptr_t ParseHex(const char*& it, const char* end) {
+		uintptr_t value = 0;
+
+		for (; it != end; ++it) {
+			const char c = *it;
+			if (c >= '0' && c <= '9')
+				value = value * 16 + (c - '0');
+			else if (c >= 'a' && c <= 'f')
+				value = value * 16 + (c - 'a' + 10);
+			else
+				break;
+		}
+
+		return value;
+	}
+
+		// Parses the next line of the maps snapshot: "begin-end perms offset dev inode path"
+	static bool NextMapping(const char*& it, Mapping& map) {
+		const char* const last = mapsBuffer + mapsSize;
+		if (it >= last)
+			return false;
+
+		map.begin = ParseHex(it, last);
+		++it;
+		map.end = ParseHex(it, last);
+		++it;
+
+		if (last - it < 5)
+			return false;
+
+		map.readable = it[0] == 'r';
+		map.writable = it[1] == 'w';
+		map.shared = it[3] == 's';
+		it += 5;
+
+			// Offset and device, then the inode is only 0 for anonymous memory
+		ParseHex(it, last);
+		++it;
+		ParseHex(it, last);
+		++it;
+		ParseHex(it, last);
+		++it;
+
+		uintptr_t inode = 0;
+		for (; it < last && *it >= '0' && *it <= '9'; ++it)
+			inode = inode * 10 + (*it - '0');
+		map.fileBacked = inode != 0;
+
+		while (it < last && *it++ != '\n') {}
+		return true;
+	}
+
+		// Finds the mapping holding 'addr' in the maps snapshot. If 'addr' isn't mapped (the stack
+		// pointer ran past the guard page), takes the first mapping above it instead.
+	static bool FindMapping(uintptr_t addr, Mapping& map) {
+		const char* it = mapsBuffer;
+
+		while (NextMapping(it, map)) {
+			if (addr < map.end)
+				return true;
+		}
+
+		return false;
+	}
+
+	static void MarkWritten(uintptr_t begin, uintptr_t end) {
+		if (writtenCount < maxRanges)
+			written[writtenCount++] = { begin, end };
+	}
+
+		// Writes one thread's registers and the live part of its stack
+	static void WriteThread(int fd, pid_t pid, pid_t tid, const gregset_t& regs) {
+		WriteRecord(fd, RecordKind::Registers, tid, &regs, sizeof(regs));
+		if (threadCount < maxThreads)
+			std::memcpy(threadRegs[threadCount++], regs, sizeof(regs));
+
+		const auto sp = static_cast<uintptr_t>(regs[REG_RSP]);
+		Mapping map;
+		if (!FindMapping(sp, map))
+			return;
+
+		const uintptr_t first = (sp - redZone > map.begin && sp - redZone < sp) ? sp - redZone : map.begin;
+		const uintptr_t last = (map.end - first > maxStackBytes) ? first + maxStackBytes : map.end;
+		MarkWritten(first, last);
+
+		const RecordHeader header{ RecordKind::Stack, static_cast<uint32_t>(tid), sizeof(uint64_t) + (last - first) };
+		const uint64_t address = first;
+		WriteAll(fd, &header, sizeof(header));
+		WriteAll(fd, &address, sizeof(address));
+
+			// process_vm_readv stops at the first page it can't read, that page gets zeroed
+			// instead of ending the record early
+		for (uintptr_t at = first; at < last; ) {
+			const size_t size = last - at < memoryBlockSize ? last - at : memoryBlockSize;
+			iovec local{ readBuffer, size }, remote{ reinterpret_cast<void*>(at), size };
+			ssize_t got = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+
+			if (got <= 0) {
+				const uintptr_t pageEnd = (at | (pageSize - 1)) + 1;
+				got = static_cast<ssize_t>((pageEnd < last ? pageEnd : last) - at);
+				std::memset(readBuffer, 0, static_cast<size_t>(got));
+			}
+
+			WriteAll(fd, readBuffer, static_cast<size_t>(got));
+			at += static_cast<uintptr_t>(got);
+		}
+	}
+
+		// LZ4 block format, so dumps can be read back with any LZ4 decoder. Greedy and single pass,
+		// which is plenty for memory that's mostly zeroes and pointers. 'dst' needs room for
+		// size + size / 255 + 16 bytes.
+	static size_t Compress(const uint8_t* src, size_t size, uint8_t* dst) {
+		uint8_t* out = dst;
+		size_t anchor = 0;
+
+		const auto putLength = [&out](size_t length) {
+			for (; length >= 255; length -= 255)
+				*out++ = 255;
+			*out++ = static_cast<uint8_t>(length);
+		};
+
+		const auto putSequence = [&](size_t literalEnd, size_t offset, size_t matchLength) {
+			const size_t literals = literalEnd - anchor;
+			uint8_t* token = out++;
+			*token = static_cast<uint8_t>((literals < 15 ? literals : 15) << 4);
+
+			if (literals >= 15)
+				putLength(literals - 15);
+			std::memcpy(out, src + anchor, literals);
+			out += literals;
+
+				// The last sequence is only literals
+			if (matchLength == 0)
+				return;
+
+			*out++ = static_cast<uint8_t>(offset);
+			*out++ = static_cast<uint8_t>(offset >> 8);
+
+			const size_t extra = matchLength - 4;
+			*token |= static_cast<uint8_t>(extra < 15 ? extra : 15);
+			if (extra >= 15)
+				putLength(extra - 15);
+		};
+
+			// The format wants the last 5 bytes as literals, and no match starting in the last 12
+		if (size > 12) {
+			std::memset(hashTable, 0, sizeof(hashTable));
+			const size_t matchStartLimit = size - 12, matchEndLimit = size - 5;
+
+			for (size_t pos = 0; pos < matchStartLimit; ) {
+				uint32_t sequence;
+				std::memcpy(&sequence, src + pos, sizeof(sequence));
+				uint32_t& slot = hashTable[(sequence * 2654435761u) >> (32 - hashBits)];
+				const size_t candidate = slot;
+				slot = static_cast<uint32_t>(pos);
+
+				uint32_t previous;
+				std::memcpy(&previous, src + candidate, sizeof(previous));
+				if (candidate >= pos || pos - candidate > 65535 || previous != sequence) {
+						// Skip ahead faster the longer nothing has matched
+					pos += 1 + ((pos - anchor) >> 6);
+					continue;
+				}
+
+				size_t length = 4;
+				while (pos + length < matchEndLimit && src[candidate + length] == src[pos + length])
+					++length;
+
+				putSequence(pos, pos - candidate, length);
+				pos += length;
+				anchor = pos;
+			}
+		}
+
+		putSequence(size, 0, 0);
+		return static_cast<size_t>(out - dst);
+	}
+
+		// Whether a page still needs to go in the dump. Pages that were never touched, and pages of
+		// private file mappings that still match the file, can be skipped. Without pagemap every
+		// page is kept.
+	static bool PageWanted(uintptr_t page, const Mapping& map) {
+		for (size_t i = 0; i < nearbyCount; ++i) {
+			if (page >= nearby[i].begin && page + pageSize <= nearby[i].end)
+				return false;
+		}
+
+		if (pagemapFd < 0)
+			return true;
+
+		const uintptr_t index = page / pageSize;
+		if (index < pagemapFirst || index >= pagemapFirst + pagemapCount) {
+			const ssize_t got = pread(pagemapFd, pagemapBuffer, sizeof(pagemapBuffer), static_cast<off_t>(index * sizeof(uint64_t)));
+			if (got <= 0)
+				return true;
+
+			pagemapFirst = index;
+			pagemapCount = static_cast<size_t>(got) / sizeof(uint64_t);
+		}
+
+		const uint64_t entry = pagemapBuffer[index - pagemapFirst];
+		const bool present = (entry >> 63) & 1, swapped = (entry >> 62) & 1, filePage = (entry >> 61) & 1;
+		if (!present && !swapped)
+			return false;
+
+		return !(filePage && map.fileBacked && !map.shared);
+	}
+
+		// Reads, compresses and writes one block. Returns false if it didn't fit in the budget.
+	static bool WriteBlock(int fd, pid_t pid, uintptr_t address, size_t size) {
+			// Fails instead of faulting if part of the block went away
+		iovec local{ readBuffer, size }, remote{ reinterpret_cast<void*>(address), size };
+		if (process_vm_readv(pid, &local, 1, &remote, 1, 0) != static_cast<ssize_t>(size))
+			return true;
+
+		const size_t packed = Compress(readBuffer, size, compressBuffer);
+		const bool stored = packed >= size;
+		const MemoryHeader memory{ address, static_cast<uint32_t>(size), stored ? 0u : static_cast<uint32_t>(packed) };
+		const size_t payload = sizeof(memory) + (stored ? size : packed);
+
+		if (dumpBudget && bytesWritten + sizeof(RecordHeader) + payload > dumpBudget)
+			return false;
+
+		const RecordHeader header{ RecordKind::Memory, 0, payload };
+		WriteAll(fd, &header, sizeof(header));
+		WriteAll(fd, &memory, sizeof(memory));
+		WriteAll(fd, stored ? readBuffer : compressBuffer, stored ? size : packed);
+		return true;
+	}
+
+		// Streams the wanted pages of [begin, end) out in blocks. Returns false once the budget runs out.
+	static bool WriteMemory(int fd, pid_t pid, const Mapping& map, uintptr_t begin, uintptr_t end) {
+			// Only ranges in this part of memory are worth checking every page against
+		nearbyCount = 0;
+		for (size_t i = 0; i < writtenCount; ++i) {
+			if (written[i].begin < end && written[i].end > begin)
+				nearby[nearbyCount++] = written[i];
+		}
+
+		for (uintptr_t page = begin; page < end; ) {
+			if (!PageWanted(page, map)) {
+				page += pageSize;
+				continue;
+			}
+
+			uintptr_t blockEnd = page + pageSize;
+			while (blockEnd < end && blockEnd - page < memoryBlockSize && PageWanted(blockEnd, map))
+				blockEnd += pageSize;
+
+			if (!WriteBlock(fd, pid, page, blockEnd - page))
+				return false;
+
+			page = blockEnd;
+		}
+
+		return true;
+	}
+
+		// Writes the pages within 'window' of 'addr', if it points at readable memory
+	static bool WriteAround(int fd, pid_t pid, uintptr_t addr, uintptr_t window) {
+		Mapping map;
+		if (!FindMapping(addr, map) || addr < map.begin || !map.readable)
+			return true;
+
+		const uintptr_t first = addr - map.begin > window ? (addr - window) & ~(pageSize - 1) : map.begin;
+		const uintptr_t last = map.end - addr > window ? ((addr + window) | (pageSize - 1)) + 1 : map.end;
+		if (!WriteMemory(fd, pid, map, first, last))
+			return false;
+
+		MarkWritten(first, last);
+		return true;
+	}
+
+		// Memory goes in order of how likely it is to matter, so the budget cuts the least useful
+		// part. Stacks were already written with their threads.
+	static void WriteProcessMemory(int fd, pid_t pid, uintptr_t faultAddr) {
+		if (dumpType == DumpType::DUMP_SMALL)
+			return;
+
+		if (!WriteAround(fd, pid, faultAddr, faultWindow))
+			return;
+
+			// Every general purpose register but the stack and instruction pointers
+		for (size_t thread = 0; thread < threadCount; ++thread) {
+			for (int reg = REG_R8; reg <= REG_RCX; ++reg) {
+				if (reg != REG_RSP && !WriteAround(fd, pid, static_cast<uintptr_t>(threadRegs[thread][reg]), registerWindow))
+					return;
+			}
+		}
+
+		if (dumpType == DumpType::DUMP_PARTIAL)
+			return;
+
+			// Then everything else. DUMP_MASSIVE also looks through read only mappings, where only
+			// pages that were changed (relocations, patched code) end up being written.
+		const char* it = mapsBuffer;
+		Mapping map;
+		while (NextMapping(it, map)) {
+			if (!map.readable || (!map.writable && dumpType != DumpType::DUMP_MASSIVE))
+				continue;
+
+			if (!WriteMemory(fd, pid, map, map.begin, map.end))
+				return;
+		}
+	}
+
+		// Runs on every other thread during a crash. Hands its registers over and then stays
+		// put, so its stack doesn't change while it's written. The process dies after the dump.
+	static void CaptureHandler(int, siginfo_t*, void* context) {
+		if (!crashing || capture.target.load(std::memory_order_acquire) != GetTid())
+			return;
+
+		std::memcpy(capture.regs, static_cast<ucontext_t*>(context)->uc_mcontext.gregs, sizeof(gregset_t));
+		capture.captured.store(true, std::memory_order_release);
+
+		for (;;)
+			pause();
+	}
+
+		// ptrace keeps the registers in a different order than gregset_t
+	static void FromUserRegs(const user_regs_struct& user, gregset_t& regs) {
+		regs[REG_R8] = user.r8;
+		regs[REG_R9] = user.r9;
+		regs[REG_R10] = user.r10;
+		regs[REG_R11] = user.r11;
+		regs[REG_R12] = user.r12;
+		regs[REG_R13] = user.r13;
+		regs[REG_R14] = user.r14;
+		regs[REG_R15] = user.r15;
+		regs[REG_RDI] = user.rdi;
+		regs[REG_RSI] = user.rsi;
+		regs[REG_RBP] = user.rbp;
+		regs[REG_RBX] = user.rbx;
+		regs[REG_RDX] = user.rdx;
+		regs[REG_RAX] = user.rax;
+		regs[REG_RCX] = user.rcx;
+		regs[REG_RSP] = user.rsp;
+		regs[REG_RIP] = user.rip;
+		regs[REG_EFL] = user.eflags;
+	}
+
+		// Helper side of stopping a thread. It stays stopped until the helper detaches.
+	static bool TraceThread(pid_t tid, gregset_t& regs) {
+		if (ptrace(PTRACE_SEIZE, tid, nullptr, nullptr) != 0)
+			return false;
+
+		if (tracedCount < maxThreads)
+			traced[tracedCount++] = tid;
+
+		int status = 0;
+		user_regs_struct user;
+		if (ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr) != 0 || waitpid(tid, &status, __WALL) != tid)
+			return false;
+		if (ptrace(PTRACE_GETREGS, tid, nullptr, &user) != 0)
+			return false;
+
+		std::memset(regs, 0, sizeof(gregset_t));
+		FromUserRegs(user, regs);
+		return true;
+	}
+
+		// Stops 'tid' and writes it out. Threads that block the signal or don't answer in time are skipped.
+	static void DumpOtherThread(int fd, pid_t pid, pid_t tid) {
+		if (inHelper) {
+			if (TraceThread(tid, capture.regs))
+				WriteThread(fd, pid, tid, capture.regs);
+			return;
+		}
+
+		capture.captured.store(false, std::memory_order_relaxed);
+		capture.target.store(tid, std::memory_order_release);
+
+		if (syscall(SYS_tgkill, pid, tid, captureSignal) != 0)
+			return;
+
+		const uint64_t deadline = MonotonicNs() + captureTimeoutNs;
+		while (!capture.captured.load(std::memory_order_acquire)) {
+			if (MonotonicNs() > deadline)
+				return;
+
+			sched_yield();
+		}
+
+		WriteThread(fd, pid, tid, capture.regs);
+	}
+
+		// opendir isn't async-signal-safe, so the task directory is read with getdents64 directly
+	static void DumpOtherThreads(int fd, pid_t pid, pid_t self) {
+		if (taskFd < 0 || lseek(taskFd, 0, SEEK_SET) != 0)
+			return;
+
+		struct LinuxDirent {
+			uint64_t inode;
+			int64_t offset;
+			unsigned short length;
+			unsigned char type;
+			char name[1];
+		};
+
+		for (;;) {
+			const long size = syscall(SYS_getdents64, taskFd, direntBuffer, sizeof(direntBuffer));
+			if (size <= 0)
+				return;
+
+			for (long pos = 0; pos < size; ) {
+				const auto* entry = reinterpret_cast<const LinuxDirent*>(direntBuffer + pos);
+				pos += entry->length;
+
+				pid_t tid = 0;
+				for (const char* c = entry->name; *c >= '0' && *c <= '9'; ++c)
+					tid = tid * 10 + (*c - '0');
+
+				if (tid != 0 && tid != self)
+					DumpOtherThread(fd, pid, tid);
+			}
+		}
+	}
+
+		// Puts the decimal form of 'value' at 'out', returns the end
+	static char* AppendNumber(char* out, uint64_t value) {
+		char digits[20];
+		int count = 0;
+
+		do {
+			digits[count++] = static_cast<char>('0' + value % 10);
+			value /= 10;
+		} while (value);
+
+		while (count)
+			*out++ = digits[--count];
+
+		return out;
+	}
+
+		// Gives the dump its final name, crash_<pid>_<unix time>.sdmp
+	static int FinishFile(int fd, pid_t pid) {
+		char name[64] = "crash_";
+		char* end = AppendNumber(name + 6, static_cast<uint64_t>(pid));
+		*end++ = '_';
+		end = AppendNumber(end, static_cast<uint64_t>(time(nullptr)));
+		std::memcpy(end, ".sdmp", 6);
+
+		if (fd >= 0) {
+			char procPath[32] = "/proc/self/fd/";
+			*AppendNumber(procPath + 14, static_cast<uint64_t>(fd)) = '\0';
+			linkat(AT_FDCWD, procPath, dumpDirFd, name, AT_SYMLINK_FOLLOW);
+			return fd;
+		}
+
+		return openat(dumpDirFd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	}
+
+		// Writes the whole dump, from the crashing process or from the helper
+	static void WriteDump(const CrashInfo& crash) {
+		dumpBudget = crash.budget;
+
+			// Without O_TMPFILE the file has to be created now and named up front
+		const int fd = dumpFd >= 0 ? dumpFd : FinishFile(-1, crash.pid);
+		if (fd < 0)
+			return;
+
+		FileHeader header;
+		header.signal = crash.signal;
+		header.code = crash.code;
+		header.faultAddr = crash.faultAddr;
+		header.pid = static_cast<uint32_t>(crash.pid);
+		header.crashTid = static_cast<uint32_t>(crash.tid);
+		WriteAll(fd, &header, sizeof(header));
+
+			// Stacks are located with a snapshot of the mappings taken before anything else runs
+		mapsSize = mapsFd >= 0 ? ReadFromStart(mapsFd, mapsBuffer, sizeof(mapsBuffer)) : 0;
+
+		WriteThread(fd, crash.pid, crash.tid, crash.regs);
+		DumpOtherThreads(fd, crash.pid, crash.tid);
+
+		WriteRecord(fd, RecordKind::Maps, crash.tid, mapsBuffer, mapsSize);
+		WriteProcessMemory(fd, crash.pid, crash.faultAddr);
+		WriteRecord(fd, RecordKind::End, crash.tid, nullptr, 0);
+
+		if (fd == dumpFd)
+			FinishFile(fd, crash.pid);
+		close(fd);
+	}
+
+		// Hands the crash to the helper and waits until it's done. False if there's no helper
+		// to hand it to, then the crashing process writes the dump itself.
+	static bool AskHelper(const CrashInfo& crash) {
+		if (helperSocket < 0 || send(helperSocket, &crash, sizeof(crash), MSG_NOSIGNAL) != sizeof(crash))
+			return false;
+
+			// A helper that hangs shouldn't keep the process from dying
+		pollfd done{ helperSocket, POLLIN, 0 };
+		while (poll(&done, 1, helperTimeoutMs) < 0 && errno == EINTR) {}
+		return true;
+	}
+
+		// The helper's whole life: wait for a crash or for the program to exit (the socket closes).
+		// Stays async-signal-safe since it was forked from a process that might have threads.
+		// PR_SET_PDEATHSIG isn't used, it fires when the forking *thread* exits, and Init can be
+		// called from a worker. A child the program forks later can keep the socket open though,
+		// so the parent is checked directly every so often too.
+	[[noreturn]] static void HelperMain(pid_t parent) {
+		inHelper = true;
+
+		pollfd request{ helperSocket, POLLIN, 0 };
+		while (getppid() == parent) {
+			const int ready = poll(&request, 1, parentCheckMs);
+			if (ready < 0 && errno != EINTR)
+				break;
+			if (ready <= 0)
+				continue;
+
+			CrashInfo crash;
+			if (recv(helperSocket, &crash, sizeof(crash), MSG_WAITALL) == sizeof(crash)) {
+				WriteDump(crash);
+
+					// Let the threads go again, the crashing thread then finishes crashing
+				for (size_t i = 0; i < tracedCount; ++i)
+					ptrace(PTRACE_DETACH, traced[i], nullptr, nullptr);
+
+				const char done = 1;
+				send(helperSocket, &done, sizeof(done), MSG_NOSIGNAL);
+			}
+
+			break;
+		}
+
+		_exit(0);
+	}
+
+		// Forks the helper and lets it ptrace this process, which Yama would block otherwise
+	static bool StartHelper() {
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0)
+			return false;
+
+		const pid_t parent = getpid();
+		const pid_t helper = fork();
+		if (helper < 0) {
+			close(sockets[0]);
+			close(sockets[1]);
+			return false;
+		}
+
+		if (helper == 0) {
+			close(sockets[0]);
+			helperSocket = sockets[1];
+			HelperMain(parent);
+		}
+
+		close(sockets[1]);
+		helperSocket = sockets[0];
+		prctl(PR_SET_PTRACER, helper);
+		return true;
+	}
+
+	static void CrashHandler(int sig, siginfo_t* info, void* context) {
+			// Another thread already crashed, and it'll take the process down when it's done
+		if (crashing.exchange(true)) {
+			for (;;)
+				pause();
+		}
+
+		CrashInfo crash;
+		crash.signal = sig;
+		crash.code = info->si_code;
+		crash.faultAddr = reinterpret_cast<uintptr_t>(info->si_addr);
+		crash.budget = dumpBudget;
+		crash.pid = getpid();
+		crash.tid = GetTid();
+		std::memcpy(crash.regs, static_cast<ucontext_t*>(context)->uc_mcontext.gregs, sizeof(gregset_t));
+
+		if (!AskHelper(crash))
+			WriteDump(crash);
+
+			// Continue crashing. The signal is blocked until this returns, so it's delivered to
+			// the old handler (or the default one) right after.
+		for (size_t i = 0; i < std::size(fatalSignals); ++i) {
+			if (fatalSignals[i] == sig)
+				sigaction(sig, &oldActions[i], nullptr);
+		}
+		raise(sig);
+	}
+
+		// Initialize the crash dump handler
+	void Init(DumpType dS, const char* dumpDir, DumpMode mode) {
+		dumpType = dS;
+
+			// Open everything now, a crash might be from running out of file descriptors
+		dumpDirFd = open(dumpDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dumpDirFd < 0)
+			error
+
+		dumpFd = openat(dumpDirFd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+		mapsFd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+		taskFd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		pagemapFd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+
+			// Forked after the fds are open so the helper has them too. The crashing thread still
+			// needs the alternate stack to run the handler that wakes the helper.
+		if (mode == DumpMode::HELPER && !StartHelper())
+			error
+
+		InitThread();
+
+			// Every thread answers captureSignal. Its handler only does anything during a crash.
+		struct sigaction action{};
+		action.sa_sigaction = CaptureHandler;
+		action.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		sigaction(captureSignal, &action, nullptr);
+
+			// Crashes run on the alternate stack. Other fatal signals wait while one is handled.
+		action.sa_sigaction = CrashHandler;
+		action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+		for (int sig : fatalSignals)
+			sigaddset(&action.sa_mask, sig);
+
+		for (size_t i = 0; i < std::size(fatalSignals); ++i)
+			sigaction(fatalSignals[i], &action, &oldActions[i]);
+	}
+
+	void InitThread() {
+		if (altStack.memory)
+			return;
+
+		void* memory = mmap(nullptr, altStackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+			error
+
+		stack_t stack{};
+		stack.ss_sp = memory;
+		stack.ss_size = altStackSize;
+		sigaltstack(&stack, nullptr);
+		altStack.memory = memory;
+	}
+
+	void SetDumpBudget(uint64_t bytes) {
+		dumpBudget = bytes;
+	}
+
+	bool RunHelper(int, char**) {
+		return false;
 	}
 
 } // namespace MiniCrashHandler
@@ -7,10 +7,263 @@
   Copyright © 2023 DigiPen (USA) Corporation.    
 *****************************************************************************/
 
-// A custom allocator that allocates data using malloc/free
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+// ----- Small object allocator -----
+// A size class allocator in the style of tcmalloc. Every thread keeps a free list per
+// size class, so most allocations never take a lock or touch another thread's memory.
+// Frees pass the size that was allocated (allocators always know it), so objects don't
+// need a header. Anything bigger than the largest class goes straight to malloc.
+namespace SmallAlloc {
+    constexpr size_t alignment = 16;
+    constexpr size_t maxSmallSize = 4096;
+    constexpr size_t classCount = 28;
+
+    // Objects get carved out of spans this big. Spans are kept for the life of the program.
+    constexpr size_t spanSize = 64 * 1024;
+
+    // 16 byte steps up to 128, then four classes per power of two up to maxSmallSize.
+    constexpr size_t SizeToClass(size_t size) {
+        if (size <= 128)
+            return size ? (size + 15) / 16 - 1 : 0;
+
+        size_t power = 8;
+        while ((size_t(1) << power) < size)
+            ++power;
+
+        const size_t step = size_t(1) << (power - 3);
+        return 8 + (power - 8) * 4 + (size - 1 - (size_t(1) << (power - 1))) / step;
+    }
+
+    constexpr size_t ClassToSize(size_t index) {
+        if (index < 8)
+            return (index + 1) * 16;
+
+        const size_t power = 8 + (index - 8) / 4;
+        return (size_t(1) << (power - 1)) + ((index - 8) % 4 + 1) * (size_t(1) << (power - 3));
+    }
+
+    static_assert(SizeToClass(maxSmallSize) == classCount - 1 && ClassToSize(classCount - 1) == maxSmallSize);
+
+    // How many objects move between a thread and the central list at once. About 16KB worth.
+    constexpr size_t BatchSize(size_t index) {
+        const size_t count = 16 * 1024 / ClassToSize(index);
+        return count < 4 ? 4 : (count > 64 ? 64 : count);
+    }
+
+    // Free objects hold the list link in their first bytes.
+    struct FreeObject {
+        FreeObject* next;
+    };
+
+    // Shared by every thread, only touched a batch at a time.
+    struct CentralList {
+        std::mutex lock;
+        FreeObject* head = nullptr;
+        size_t count = 0;
+    };
+    inline CentralList central[classCount];
+
+    struct ThreadCache {
+        FreeObject* lists[classCount] = {};
+        size_t counts[classCount] = {};
+
+        ~ThreadCache();
+    };
+    inline thread_local ThreadCache cache;
+
+    // Thread locals can be destroyed before other thread locals that still allocate or free
+    // memory. The cache can't be touched at all once it's gone, but a plain bool has no
+    // destructor, so this one stays readable until the thread is really done.
+    inline thread_local bool cacheExited = false;
+
+    // Hands objects over to the central list. 'last' is the end of the chain starting at 'first'.
+    inline void PushCentral(size_t index, FreeObject* first, FreeObject* last, size_t count) {
+        CentralList& list = central[index];
+        std::scoped_lock lock{ list.lock };
+
+        last->next = list.head;
+        list.head = first;
+        list.count += count;
+    }
+
+    // Carves a new span up into objects of 'size' bytes. 'list' has to be locked.
+    inline bool Grow(CentralList& list, size_t size) {
+        auto* span = static_cast<char*>(std::malloc(spanSize));
+        if (!span)
+            return false;
+
+        for (size_t offset = 0; offset + size <= spanSize; offset += size) {
+            auto* object = reinterpret_cast<FreeObject*>(span + offset);
+            object->next = list.head;
+            list.head = object;
+            ++list.count;
+        }
+
+        return true;
+    }
+
+    // Moves a batch from the central list to this thread, carving up a new span if it ran dry.
+    inline void Refill(ThreadCache& tc, size_t index) {
+        CentralList& list = central[index];
+        const size_t batch = BatchSize(index);
+        std::scoped_lock lock{ list.lock };
+
+        if (list.count < batch && !Grow(list, ClassToSize(index)))
+            return;
+
+        FreeObject* first = list.head;
+        FreeObject* last = first;
+        for (size_t i = 1; i < batch; ++i)
+            last = last->next;
+
+        list.head = last->next;
+        list.count -= batch;
+
+        last->next = tc.lists[index];
+        tc.lists[index] = first;
+        tc.counts[index] += batch;
+    }
+
+    // Gives a batch back once a thread is holding too many, so memory freed by one thread
+    // can be reused by another.
+    inline void Release(ThreadCache& tc, size_t index) {
+        const size_t batch = BatchSize(index);
+        FreeObject* first = tc.lists[index];
+        FreeObject* last = first;
+        for (size_t i = 1; i < batch; ++i)
+            last = last->next;
+
+        tc.lists[index] = last->next;
+        tc.counts[index] -= batch;
+        PushCentral(index, first, last, batch);
+    }
+
+    // Gives everything a thread holds in one class back.
+    inline void ReleaseAll(ThreadCache& tc, size_t index) {
+        if (!tc.lists[index])
+            return;
+
+        FreeObject* last = tc.lists[index];
+        while (last->next)
+            last = last->next;
+
+        PushCentral(index, tc.lists[index], last, tc.counts[index]);
+        tc.lists[index] = nullptr;
+        tc.counts[index] = 0;
+    }
+
+    inline ThreadCache::~ThreadCache() {
+        for (size_t index = 0; index < classCount; ++index)
+            ReleaseAll(*this, index);
+
+        cacheExited = true;
+    }
+
+    // For a thread whose cache is gone. Takes a single object straight from the central list.
+    inline void* AllocateCentral(size_t index) {
+        CentralList& list = central[index];
+        std::scoped_lock lock{ list.lock };
+
+        if (!list.head && !Grow(list, ClassToSize(index)))
+            return nullptr;
+
+        FreeObject* object = list.head;
+        list.head = object->next;
+        --list.count;
+        return object;
+    }
+
+    inline void* Allocate(size_t size) {
+        if (size > maxSmallSize)
+            return std::malloc(size);
+
+        const size_t index = SizeToClass(size);
+        if (cacheExited)
+            return AllocateCentral(index);
+
+        ThreadCache& tc = cache;
+        if (!tc.lists[index]) {
+            Refill(tc, index);
+            if (!tc.lists[index])
+                return nullptr;
+        }
+
+        FreeObject* object = tc.lists[index];
+        tc.lists[index] = object->next;
+        --tc.counts[index];
+        return object;
+    }
+
+    // 'size' has to be the size that was passed to Allocate.
+    inline void Deallocate(void* addr, size_t size) {
+        if (!addr)
+            return;
+
+        if (size > maxSmallSize) {
+            std::free(addr);
+            return;
+        }
+
+        const size_t index = SizeToClass(size);
+        auto* object = static_cast<FreeObject*>(addr);
+
+        if (cacheExited) {
+            PushCentral(index, object, object, 1);
+            return;
+        }
+
+        ThreadCache& tc = cache;
+        object->next = tc.lists[index];
+        tc.lists[index] = object;
+
+        if (++tc.counts[index] > 2 * BatchSize(index))
+            Release(tc, index);
+    }
+} // namespace SmallAlloc
+
+// A custom allocator that allocates data using the small object allocator
 // rather than new/delete, since the debugger relies on overriding
-// new and delete.
-class MAllocator { ... };
+// new and delete. Meets the standard allocator requirements, so any
+// container in the project can use it.
+template <typename T>
+class MAllocator {
+public:
+    static_assert(alignof(T) <= SmallAlloc::alignment, "over-aligned types need their own allocator");
+
+    using value_type = T;
+
+    MAllocator() noexcept = default;
+
+    template <typename U>
+    MAllocator(const MAllocator<U>&) noexcept {}
+
+    T* allocate(size_t count) {
+        void* data = count <= SIZE_MAX / sizeof(T) ? SmallAlloc::Allocate(count * sizeof(T)) : nullptr;
+
+        if (!data) {
+            // Same reasoning as the one in DebugNew.
+            static std::bad_alloc outOfMem;
+            throw outOfMem;
+        }
+
+        return static_cast<T*>(data);
+    }
+
+    void deallocate(T* addr, size_t count) noexcept {
+        SmallAlloc::Deallocate(addr, count * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const MAllocator<U>&) const noexcept { return true; }
+
+    template <typename U>
+    bool operator!=(const MAllocator<U>&) const noexcept { return false; }
+};
 
 // Logger structure to write leak data.
 class Logger { ... };
@@ -294,3 +547,113 @@ LeakInfo MemDebugger::GetLeakInfo(MemInfo& mInf, MemIssue issue) {
 
     return LeakInfo{ ... };
 }
+
+
+// ----- Allocator benchmark -----
+// Build with MEMDEBUGGER_BENCHMARK defined (and without the new/delete overrides)
+// to compare the small object allocator against plain malloc/free.
+#ifdef MEMDEBUGGER_BENCHMARK
+#include <chrono>
+#include <cstdio>
+#include <list>
+#include <random>
+#include <thread>
+#include <vector>
+
+// What MAllocator used to be, for comparison.
+template <typename T>
+struct MallocAllocator {
+    using value_type = T;
+
+    MallocAllocator() noexcept = default;
+
+    template <typename U>
+    MallocAllocator(const MallocAllocator<U>&) noexcept {}
+
+    T* allocate(size_t count) { return static_cast<T*>(std::malloc(count * sizeof(T))); }
+    void deallocate(T* addr, size_t) noexcept { std::free(addr); }
+
+    template <typename U>
+    bool operator==(const MallocAllocator<U>&) const noexcept { return true; }
+
+    template <typename U>
+    bool operator!=(const MallocAllocator<U>&) const noexcept { return false; }
+};
+
+struct MallocApi {
+    static void* Allocate(size_t size) { return std::malloc(size); }
+    static void Deallocate(void* addr, size_t) { std::free(addr); }
+};
+
+struct SmallAllocApi {
+    static void* Allocate(size_t size) { return SmallAlloc::Allocate(size); }
+    static void Deallocate(void* addr, size_t size) { SmallAlloc::Deallocate(addr, size); }
+};
+
+// Random sized allocations and frees with a few thousand objects alive at once,
+// roughly what the debugger's bookkeeping looks like.
+template <typename Api>
+void Churn(unsigned seed, size_t operations) {
+    std::minstd_rand random{ seed };
+    std::vector<std::pair<void*, size_t>> live;
+    live.reserve(4096);
+
+    for (size_t i = 0; i < operations; ++i) {
+        if (live.size() < 2048 || (random() & 1)) {
+            const size_t size = 8 + random() % 504;
+            live.emplace_back(Api::Allocate(size), size);
+        }
+        else {
+            const size_t index = random() % live.size();
+            Api::Deallocate(live[index].first, live[index].second);
+            live[index] = live.back();
+            live.pop_back();
+        }
+    }
+
+    for (auto [addr, size] : live)
+        Api::Deallocate(addr, size);
+}
+
+// Nanoseconds per operation with 'threads' threads churning at once.
+template <typename Api>
+double TimeChurn(size_t threads, size_t operations) {
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i)
+        workers.emplace_back(Churn<Api>, static_cast<unsigned>(i + 1), operations);
+    for (auto& worker : workers)
+        worker.join();
+
+    const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / (threads * operations);
+}
+
+template <template <typename> typename Alloc>
+double TimeList(size_t count) {
+    const auto start = std::chrono::steady_clock::now();
+
+    for (int round = 0; round < 10; ++round) {
+        std::list<size_t, Alloc<size_t>> list;
+        for (size_t i = 0; i < count; ++i)
+            list.push_back(i);
+    }
+
+    const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / (10 * count);
+}
+
+int main() {
+    constexpr size_t operations = 4'000'000;
+
+    std::printf("threads  malloc ns/op  small ns/op\n");
+    for (size_t threads : { 1, 2, 4, 8 }) {
+        std::printf("%7zu  %12.1f  %11.1f\n", threads,
+            TimeChurn<MallocApi>(threads, operations), TimeChurn<SmallAllocApi>(threads, operations));
+    }
+
+    std::printf("\nlist push_back  malloc %.1f ns  small %.1f ns\n",
+        TimeList<MallocAllocator>(1'000'000), TimeList<MAllocator>(1'000'000));
+}
+#endif
@@ -0,0 +1,387 @@
+/*****************************************************************************
+	A command line tool that compares two runs of the sampler profiler, meant
+	for catching performance regressions before they get merged. Reads the
+	chunk files SProfiler writes (SaveSamples, or a continuous mode directory).
+
+	Usage: ProfileDiff [options] <base> <new>
+		--json             machine readable output
+		--budget <pct>     exit with 1 if a function's share grew by more than
+		                   this many percentage points
+		--z <value>        z score a change needs to count (default 3)
+		--min-share <pct>  smallest change in share that's reported (default 0.5)
+		--source <name>    timer, cycles, cache-misses or branch-misses (default timer)
+		--off-cpu          include blocked samples
+		--top <n>          how many functions to list each way (default 20)
+
+	Author(s): Evan O'Bryant
+	Copyright © 2023 DigiPen (USA) Corporation.
+*****************************************************************************/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+	// Match SProfiler::SampleSource and SProfiler::ThreadState
+constexpr const char* sourceNames[] = { "timer", "cycles", "cache-misses", "branch-misses" };
+constexpr uint8_t blockedState = 3;
+
+	// Exit codes
+constexpr int exitOk = 0, exitOverBudget = 1, exitBadInput = 2;
+
+struct Options {
+	bool json = false;
+	bool offCpu = false;
+	uint8_t source = 0;
+	double zThreshold = 3;
+		// In percentage points
+	double minShare = 0.5;
+	double budget = -1;
+	size_t top = 20;
+	std::filesystem::path basePath, newPath;
+};
+
+	// Function name -> samples, for one side of the comparison
+struct Profile {
+	std::unordered_map<std::string, uint64_t> counts;
+	uint64_t total = 0;
+};
+
+	// How one function's share of the samples moved between runs. Shares are in percent.
+struct Change {
+	std::string_view name;
+	double baseShare, newShare, delta, z;
+};
+
+	// Walks a chunk. Every read is bounds checked, so a truncated chunk just fails to read.
+class ChunkReader {
+public:
+	explicit ChunkReader(std::string_view data) : data(data) {}
+
+	bool Varint(uint64_t& out) {
+		out = 0;
+		for (int shift = 0; shift < 64 && pos < data.size(); shift += 7) {
+			const auto byte = static_cast<uint8_t>(data[pos++]);
+			out |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+			if (!(byte & 0x80))
+				return true;
+		}
+
+		return false;
+	}
+
+	bool Bytes(uint64_t size, std::string_view& out) {
+		if (size > data.size() - pos)
+			return false;
+
+		out = data.substr(pos, size);
+		pos += size;
+		return true;
+	}
+
+	bool Byte(uint8_t& out) {
+		if (pos == data.size())
+			return false;
+
+		out = static_cast<uint8_t>(data[pos++]);
+		return true;
+	}
+
+private:
+	std::string_view data;
+	size_t pos = 0;
+};
+
+	// Reads the samples in one chunk file and the reason it was written. See WriteChunk in
+	// Profiler.cpp for the layout. 'chunk' and 'reason' are only filled in if the whole file parses.
+bool LoadChunk(const std::filesystem::path& path, const Options& options, Profile& chunk, std::string& reason) {
+	std::ifstream file{ path, std::ios::binary };
+	const std::string contents{ std::istreambuf_iterator<char>(file), {} };
+	ChunkReader reader{ contents };
+
+	std::string_view magic, reasonText, ticksPerMicro;
+	uint64_t version = 0, reasonSize = 0, addrCount = 0;
+
+	if (!reader.Bytes(4, magic) || magic != "SPRC" || !reader.Varint(version) || version < 1 || version > 2)
+		return false;
+	if (!reader.Varint(reasonSize) || !reader.Bytes(reasonSize, reasonText) || !reader.Bytes(sizeof(double), ticksPerMicro))
+		return false;
+	if (!reader.Varint(addrCount))
+		return false;
+
+	std::vector<std::string_view> names;
+	for (uint64_t i = 0; i < addrCount; ++i) {
+		uint64_t addr = 0, nameSize = 0;
+		std::string_view name;
+
+		if (!reader.Varint(addr) || !reader.Varint(nameSize) || !reader.Bytes(nameSize, name))
+			return false;
+
+		names.push_back(name.empty() ? "[unknown]" : name);
+	}
+
+	uint64_t sampleCount = 0, firstTick = 0;
+	if (!reader.Varint(sampleCount) || !reader.Varint(firstTick))
+		return false;
+
+	Profile result;
+	for (uint64_t i = 0; i < sampleCount; ++i) {
+		uint64_t index = 0, tickDelta = 0;
+		uint8_t kind = 0;
+
+		if (!reader.Varint(index) || !reader.Varint(tickDelta) || (version >= 2 && !reader.Byte(kind)) || index >= names.size())
+			return false;
+
+		if ((kind >> 4) != options.source || ((kind & 0xF) == blockedState && !options.offCpu))
+			continue;
+
+		++result.counts[std::string(names[index])];
+		++result.total;
+	}
+
+	chunk = std::move(result);
+	reason = reasonText;
+	return true;
+}
+
+void Merge(Profile& into, const Profile& from) {
+	for (const auto& [name, count] : from.counts)
+		into.counts[name] += count;
+
+	into.total += from.total;
+}
+
+	// A path can be a single chunk, or a directory of them (continuous mode output, or several
+	// SaveSamples runs). Window dumps in a directory are skipped, each one repeats samples the
+	// periodic chunks already cover.
+bool LoadProfile(const std::filesystem::path& path, const Options& options, Profile& profile) {
+	std::error_code error;
+	Profile chunk;
+	std::string reason;
+
+	if (!std::filesystem::is_directory(path, error)) {
+		if (!LoadChunk(path, options, chunk, reason))
+			return false;
+
+		Merge(profile, chunk);
+		return true;
+	}
+
+	std::vector<std::filesystem::path> chunks;
+	for (const auto& entry : std::filesystem::directory_iterator(path, error)) {
+		if (entry.path().extension() == ".sprc")
+			chunks.push_back(entry.path());
+	}
+
+	std::sort(chunks.begin(), chunks.end());
+	size_t loaded = 0;
+	for (const auto& chunkPath : chunks) {
+		if (!LoadChunk(chunkPath, options, chunk, reason)) {
+			std::fprintf(stderr, "Skipping %s, not a valid chunk\n", chunkPath.string().c_str());
+			continue;
+		}
+
+		if (reason != "flush" && reason != "exit" && reason != "save") {
+			std::fprintf(stderr, "Skipping %s, a window dump (\"%s\")\n", chunkPath.string().c_str(), reason.c_str());
+			continue;
+		}
+
+		Merge(profile, chunk);
+		++loaded;
+	}
+
+	return loaded > 0;
+}
+
+	// Compares each function's share of the samples with a two proportion z-test, so a small
+	// profile's noise doesn't get reported as a regression
+std::vector<Change> Compare(const Profile& base, const Profile& next) {
+	std::unordered_map<std::string_view, std::pair<uint64_t, uint64_t>> counts;
+	for (const auto& [name, count] : base.counts)
+		counts[name].first = count;
+	for (const auto& [name, count] : next.counts)
+		counts[name].second = count;
+
+	const double n1 = static_cast<double>(base.total), n2 = static_cast<double>(next.total);
+	std::vector<Change> changes;
+
+	for (const auto& [name, count] : counts) {
+		const double p1 = count.first / n1, p2 = count.second / n2;
+		const double pooled = (count.first + count.second) / (n1 + n2);
+		const double stdError = std::sqrt(pooled * (1 - pooled) * (1 / n1 + 1 / n2));
+
+		changes.push_back(Change{ name, p1 * 100, p2 * 100, (p2 - p1) * 100,
+			stdError > 0 ? (p2 - p1) / stdError : 0 });
+	}
+
+	std::sort(changes.begin(), changes.end(),
+		[](const Change& a, const Change& b) { return a.delta > b.delta; });
+
+	return changes;
+}
+
+void PrintJsonString(std::string_view str) {
+	std::putchar('"');
+	for (char c : str) {
+		if (c == '"' || c == '\\')
+			std::putchar('\\');
+
+		if (static_cast<unsigned char>(c) >= 0x20)
+			std::putchar(c);
+	}
+	std::putchar('"');
+}
+
+void PrintText(const Options& options, const Profile& base, const Profile& next,
+	const std::vector<const Change*>& grew, const std::vector<const Change*>& shrank)
+{
+	std::printf("base: %llu samples (%s)\n", static_cast<unsigned long long>(base.total), options.basePath.string().c_str());
+	std::printf("new:  %llu samples (%s)\n", static_cast<unsigned long long>(next.total), options.newPath.string().c_str());
+
+	const auto printList = [&options](const char* title, const std::vector<const Change*>& list) {
+		std::printf("\n%s:\n", title);
+		if (list.empty())
+			std::printf("  (none)\n");
+
+		for (size_t i = 0; i < list.size() && i < options.top; ++i) {
+			const Change& change = *list[i];
+			std::printf("  %+7.2f%%  %6.2f%% -> %6.2f%%  z=%+6.1f  %.*s\n", change.delta, change.baseShare,
+				change.newShare, change.z, static_cast<int>(change.name.size()), change.name.data());
+		}
+	};
+
+	printList("Grew", grew);
+	printList("Shrank", shrank);
+}
+
+void PrintJson(const Options& options, const Profile& base, const Profile& next,
+	const std::vector<const Change*>& grew, const std::vector<const Change*>& shrank, bool overBudget)
+{
+	std::printf("{\"base_samples\":%llu,\"new_samples\":%llu,\"budget\":%g,\"over_budget\":%s,",
+		static_cast<unsigned long long>(base.total), static_cast<unsigned long long>(next.total),
+		options.budget, overBudget ? "true" : "false");
+
+	const auto printList = [&options](const char* key, const std::vector<const Change*>& list) {
+		std::printf("\"%s\":[", key);
+
+		for (size_t i = 0; i < list.size() && i < options.top; ++i) {
+			const Change& change = *list[i];
+
+			std::printf(i ? ",{\"name\":" : "{\"name\":");
+			PrintJsonString(change.name);
+			std::printf(",\"base_share\":%.4f,\"new_share\":%.4f,\"delta\":%.4f,\"z\":%.3f}",
+				change.baseShare, change.newShare, change.delta, change.z);
+		}
+
+		std::printf("]");
+	};
+
+	printList("grew", grew);
+	std::printf(",");
+	printList("shrank", shrank);
+	std::printf("}\n");
+}
+
+bool ParseArgs(int argc, char** argv, Options& options) {
+	std::vector<std::string_view> paths;
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string_view arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+
+		if (arg == "--json")
+			options.json = true;
+		else if (arg == "--off-cpu")
+			options.offCpu = true;
+		else if (arg == "--budget" && hasValue)
+			options.budget = std::atof(argv[++i]);
+		else if (arg == "--z" && hasValue)
+			options.zThreshold = std::atof(argv[++i]);
+		else if (arg == "--min-share" && hasValue)
+			options.minShare = std::atof(argv[++i]);
+		else if (arg == "--top" && hasValue)
+			options.top = std::strtoull(argv[++i], nullptr, 10);
+		else if (arg == "--source" && hasValue) {
+			const std::string_view name = argv[++i];
+			const auto it = std::find(std::begin(sourceNames), std::end(sourceNames), name);
+
+			if (it == std::end(sourceNames))
+				return false;
+
+			options.source = static_cast<uint8_t>(it - std::begin(sourceNames));
+		}
+		else if (arg.starts_with("--"))
+			return false;
+		else
+			paths.push_back(arg);
+	}
+
+	if (paths.size() != 2)
+		return false;
+
+	options.basePath = paths[0];
+	options.newPath = paths[1];
+	return true;
+}
+} // namespace
+
+int main(int argc, char** argv) {
+	Options options;
+	if (!ParseArgs(argc, argv, options)) {
+		std::fprintf(stderr, "Usage: ProfileDiff [--json] [--budget pct] [--z value] [--min-share pct]\n"
+			"                   [--source name] [--off-cpu] [--top n] <base> <new>\n");
+		return exitBadInput;
+	}
+
+	Profile base, next;
+	if (!LoadProfile(options.basePath, options, base) || !LoadProfile(options.newPath, options, next)) {
+		std::fprintf(stderr, "Couldn't read the profiles\n");
+		return exitBadInput;
+	}
+
+	if (base.total == 0 || next.total == 0) {
+		std::fprintf(stderr, "A profile has no %s samples\n", sourceNames[options.source]);
+		return exitBadInput;
+	}
+
+		// Only changes that are both statistically significant and big enough to care about
+	const std::vector<Change> changes = Compare(base, next);
+	std::vector<const Change*> grew, shrank;
+	bool overBudget = false;
+
+	for (const Change& change : changes) {
+		if (std::abs(change.z) < options.zThreshold || std::abs(change.delta) < options.minShare)
+			continue;
+
+		if (change.delta > 0) {
+			grew.push_back(&change);
+			overBudget |= options.budget >= 0 && change.delta > options.budget;
+		}
+		else {
+			shrank.push_back(&change);
+		}
+	}
+
+		// Biggest drop first
+	std::reverse(shrank.begin(), shrank.end());
+
+	if (options.json)
+		PrintJson(options, base, next, grew, shrank, overBudget);
+	else
+		PrintText(options, base, next, grew, shrank);
+
+	if (overBudget && !options.json)
+		std::printf("\nRegression budget of %.2f%% exceeded\n", options.budget);
+
+	return overBudget ? exitOverBudget : exitOk;
+}
@@ -1,6 +1,6 @@
 /*****************************************************************************
-	A sampler profiler for Windows. Cross platform support exists, but only
-	Windows has an implementation.
+	A sampler profiler for Windows and Linux. Cross platform support exists,
+	Windows and Linux both have an implementation.
 	Some details redacted to prevent future students in this class from seeing
 	this code and using it to cheat in the class. Some syntax is purposefully
 	incorrect.
@@ -9,35 +9,525 @@
 	Copyright © 2023 DigiPen (USA) Corporation.    
 *****************************************************************************/
 
+#include <algorithm>
 #include <atomic>
+#include <bit>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 #include <thread>
 #include <iostream>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
 namespace SProfiler {
+	// What triggered a sample. Timer samples come from the profiler thread's clock, the rest
+	// from hardware counter overflows (see StartCounters).
+enum class SampleSource : uint8_t {
+	Timer,
+	Cycles,
+	CacheMisses,
+	BranchMisses,
+	Count
+};
+
+inline const char* SourceName(SampleSource source) {
+	constexpr const char* names[] = { "timer", "cycles", "cache-misses", "branch-misses" };
+	return names[static_cast<size_t>(source)];
+}
+
+	// What the main thread was doing when an off-CPU sample was taken (see Start)
+enum class ThreadState : uint8_t {
+	Unknown,
+	Running,
+		// Wanted to run, but was waiting for a core
+	Runnable,
+		// Waiting on a lock, I/O, a sleep, etc.
+	Blocked
+};
+
+	// Sample::waitReason when a blocked thread wasn't in a system call
+constexpr uint16_t noWaitReason = UINT16_MAX;
+
+	// One RIP sample. Kept small so the ring buffer stays cache friendly at high rates.
+	// For blocked samples 'rip' is the blocking call site.
+struct Sample {
+	void* rip;
+	uint64_t tick;
+	SampleSource source = SampleSource::Timer;
+	ThreadState state = ThreadState::Unknown;
+		// System call the thread was blocked in, platform specific
+	uint16_t waitReason = noWaitReason;
+};
+
+	// Function name -> number of samples, sorted hottest first
+using HeatMap = std::vector<std::pair<std::string_view, size_t>>;
+
+	// An executable mapping of a module (exe or shared library) in the process
+struct ModuleInfo {
+	uintptr_t begin, end;
+		// File offset 'begin' was mapped from
+	uintptr_t offset;
+	std::string path;
+};
+
+	// Where an address came from in the source. 'line' is 0 if there was no line info.
+struct SourceLine {
+	std::string file;
+	unsigned line = 0;
+};
+
+	// One line of a hot function's listing
+struct AnnotatedLine {
+	SourceLine source;
+	size_t samples;
+		// The line itself, if the source file could be found
+	std::string text;
+};
+
+	// A hot function broken down by line, lines sorted by file and then line number
+struct AnnotatedFunction {
+	std::string_view name;
+	size_t samples;
+	std::vector<AnnotatedLine> lines;
+};
+
+namespace internal {
+class Logger { ... };
+
+	// Fixed capacity single producer/single consumer queue. All memory is allocated
+	// up front, so pushing from the profiler thread never touches the allocator.
+template <typename T>
+class RingBuffer {
+public:
+		// Not thread safe, only call while neither side is running.
+	void Reset(size_t capacity) {
+		buffer.assign(std::bit_ceil(capacity), T{});
+		mask = buffer.size() - 1;
+		head = 0;
+		tail = 0;
+	}
+
+		// Producer only. Returns false if the consumer fell behind and the item was dropped.
+	bool Push(const T& item) {
+		const size_t h = head.load(std::memory_order_relaxed);
+
+		if (h - tail.load(std::memory_order_acquire) == buffer.size())
+			return false;
+
+		buffer[h & mask] = item;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+		// Consumer only. Copies up to 'max' items into 'out' and returns how many were copied.
+	size_t PopBulk(T* out, size_t max) {
+		const size_t t = tail.load(std::memory_order_relaxed);
+		const size_t count = std::min(head.load(std::memory_order_acquire) - t, max);
+
+		for (size_t i = 0; i < count; ++i)
+			out[i] = buffer[(t + i) & mask];
+
+		tail.store(t + count, std::memory_order_release);
+		return count;
+	}
+
+	bool Empty() const {
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+private:
+	std::vector<T> buffer;
+	size_t mask = 0;
+
+		// Kept on separate cache lines so the two threads don't fight over them
+	alignas(64) std::atomic_size_t head = 0;
+	alignas(64) std::atomic_size_t tail = 0;
+};
+
+	// Fixed capacity sample storage. Either stops taking samples once full, or keeps
+	// overwriting the oldest ones so it always holds the most recent window.
+class SampleWindow {
+public:
+	void Reset(size_t capacity, bool overwrite) {
+		samples.assign(capacity, Sample{});
+		this->overwrite = overwrite;
+		total = 0;
+	}
+
+	void Append(const Sample* in, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			if (samples.empty() || (total >= samples.size() && !overwrite))
+				return;
+
+			samples[total % samples.size()] = in[i];
+			++total;
+		}
+	}
+
+		// Copies every sample numbered 'first' or later that's still in the window, oldest first
+	void CopySince(uint64_t first, std::vector<Sample>& out) const {
+		const uint64_t oldest = total > samples.size() ? total - samples.size() : 0;
+
+		for (uint64_t i = std::max(first, oldest); i < total; ++i)
+			out.push_back(samples[i % samples.size()]);
+	}
+
+		// Number of samples ever appended, including ones that were overwritten since
+	uint64_t Total() const { return total; }
+
+private:
+	std::vector<Sample> samples;
+	bool overwrite = false;
+	uint64_t total = 0;
+};
+
+	// How well the profiler thread kept to its schedule. Only the profiler thread writes to
+	// it, relaxed atomics just let Report() read it while recording.
+struct ClockStats {
+	std::atomic_uint64_t taken = 0;
+	std::atomic_uint64_t missed = 0;
+	std::atomic_int64_t firstNs = 0, lastNs = 0;
+		// How far past each deadline the thread actually woke up
+	std::atomic_int64_t maxLateNs = 0;
+	std::atomic<double> sumLateNs = 0, sumLateSqNs = 0;
+
+	void Reset() {
+		taken = missed = 0;
+		firstNs = lastNs = maxLateNs = 0;
+		sumLateNs = sumLateSqNs = 0;
+	}
+
+	void Add(std::chrono::steady_clock::time_point woke, std::chrono::nanoseconds late) {
+		constexpr auto relaxed = std::memory_order_relaxed;
+		const int64_t wokeNs = woke.time_since_epoch().count();
+		const double lateNs = static_cast<double>(late.count());
+
+		if (taken.load(relaxed) == 0)
+			firstNs.store(wokeNs, relaxed);
+
+		lastNs.store(wokeNs, relaxed);
+		maxLateNs.store(std::max(maxLateNs.load(relaxed), late.count()), relaxed);
+		sumLateNs.store(sumLateNs.load(relaxed) + lateNs, relaxed);
+		sumLateSqNs.store(sumLateSqNs.load(relaxed) + lateNs * lateNs, relaxed);
+		taken.fetch_add(1, relaxed);
+	}
+};
+
+	// Time the profiler spends on its own work, in ticks. Each field has a single writer
+	// except symbolizing, which is why they're all atomics.
+struct OverheadStats {
+		// Taking the sample. The main thread is stalled for (at most) this long.
+	std::atomic_uint64_t captureTicks = 0;
+	std::atomic_uint64_t pushTicks = 0;
+	std::atomic_uint64_t drainTicks = 0;
+	std::atomic_uint64_t symbolizeTicks = 0;
+	std::atomic_uint64_t captures = 0;
+	std::atomic_uint64_t startTick = 0, stopTick = 0;
+
+	void Reset(uint64_t now) {
+		captureTicks = pushTicks = drainTicks = symbolizeTicks = captures = 0;
+		startTick = now;
+		stopTick = 0;
+	}
+};
+
+	// Enough slack for the drain thread to fall ~1.5s behind at 10 kHz before dropping samples
+constexpr size_t ringCapacity = 1 << 14;
+	// 1 MHz. The sample period is kept in whole microseconds, anything faster would round it to 0.
+constexpr size_t maxSamplesPerMilli = 1000;
+	// How long the drain thread waits when the ring is empty
+constexpr std::chrono::milliseconds drainInterval{ 2 };
+	// How many of the hottest functions get a per line listing in the report
+constexpr size_t annotatedFunctions = 5;
+
+	// How often the counter thread empties the kernel's sample buffers
+constexpr std::chrono::milliseconds counterPollInterval{ 1 };
+	// How often the flush thread checks for a requested dump in continuous mode
+constexpr std::chrono::milliseconds dumpPollInterval{ 50 };
+
+	// Appends an unsigned LEB128 value, used by the chunk format (and protobuf)
+inline void PutVarint(std::string& out, uint64_t value) {
+	while (value >= 0x80) {
+		out += static_cast<char>(value | 0x80);
+		value >>= 7;
+	}
+	out += static_cast<char>(value);
+}
+
+	// Just enough of the protobuf wire format to write a pprof profile
+class ProtoWriter {
+public:
+	void Varint(uint32_t field, uint64_t value) {
+		PutVarint(buffer, field << 3 | 0);
+		PutVarint(buffer, value);
+	}
+
+	void Bytes(uint32_t field, std::string_view value) {
+		PutVarint(buffer, field << 3 | 2);
+		PutVarint(buffer, value.size());
+		buffer += value;
+	}
+
+	void Message(uint32_t field, const ProtoWriter& message) {
+		Bytes(field, message.buffer);
+	}
+
+	void Packed(uint32_t field, const std::vector<uint64_t>& values) {
+		std::string packed;
+		for (uint64_t value : values)
+			PutVarint(packed, value);
+
+		Bytes(field, packed);
+	}
+
+	const std::string& Data() const { return buffer; }
+
+private:
+	std::string buffer;
+};
+
+	// Samples and zones share the same TSC timebase so they can be lined up in a trace
+inline uint64_t Now() {
+	return __rdtsc();
+}
+
+	// Measured once in Init(), used to turn ticks into trace timestamps
+inline double ticksPerMicro = 1;
+
+static void CalibrateTicks() {
+	const auto wallStart = std::chrono::steady_clock::now();
+	const uint64_t tickStart = Now();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	const uint64_t ticks = Now() - tickStart;
+	const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - wallStart;
+	ticksPerMicro = ticks / elapsed.count();
+}
+
+	// One finished SPROFILE_SCOPE
+struct ZoneEvent {
+	const char* name;
+	uint64_t begin, end;
+};
+
+	// Zones recorded by a single thread. Only its owner writes to it, 'count' is published
+	// with release so the trace writer can read everything before it while the thread runs.
+struct ZoneBuffer {
+	uint32_t threadId;
+	std::unique_ptr<ZoneEvent[]> events;
+	std::atomic_size_t count = 0;
+	size_t dropped = 0;
+};
+
+	// Per thread buffers, allocated the first time a thread records a zone
+constexpr size_t zoneCapacity = 1 << 16;
+
+	// Checked by every zone. A relaxed load is all a disabled zone costs.
+inline std::atomic_bool zonesEnabled = false;
+
+	// Owns every thread's buffer, so recorded zones outlive the threads that made them
+inline struct ZoneRegistry {
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ZoneBuffer>> buffers;
+	std::thread::id mainThread;
+	uint32_t nextThreadId = 1;
+} zoneRegistry;
+
+static ZoneBuffer& ThisThreadZones() {
+	thread_local ZoneBuffer* buffer = nullptr;
+
+	if (!buffer) {
+		auto newBuffer = std::make_unique<ZoneBuffer>();
+		newBuffer->events = std::make_unique<ZoneEvent[]>(zoneCapacity);
+
+		std::scoped_lock lock{ zoneRegistry.mutex };
+			// Main thread is always 0, that's also where its samples end up in the trace
+		newBuffer->threadId = std::this_thread::get_id() == zoneRegistry.mainThread
+			? 0 : zoneRegistry.nextThreadId++;
+
+		buffer = zoneRegistry.buffers.emplace_back(std::move(newBuffer)).get();
+	}
+
+	return *buffer;
+}
+
+inline void RecordZone(const char* name, uint64_t begin, uint64_t end) {
+	ZoneBuffer& zones = ThisThreadZones();
+	const size_t i = zones.count.load(std::memory_order_relaxed);
+
+	if (i == zoneCapacity) {
+		++zones.dropped;
+		return;
+	}
+
+	zones.events[i] = ZoneEvent{ name, begin, end };
+	zones.count.store(i + 1, std::memory_order_release);
+}
+} // namespace internal
+
+	// RAII timer for a block of code, use through SPROFILE_SCOPE.
+	// 'name' has to outlive the profiler, string literals are expected.
+class Zone {
+public:
+	explicit Zone(const char* name)
+		: name(name)
+		, begin(internal::zonesEnabled.load(std::memory_order_relaxed) ? internal::Now() : 0) {}
+
+	~Zone() {
+		if (begin != 0)
+			internal::RecordZone(name, begin, internal::Now());
+	}
+
+	Zone(const Zone&) = delete;
+	Zone& operator=(const Zone&) = delete;
+
+private:
+	const char* name;
+	uint64_t begin;
+};
+
+#define SPROFILE_CONCAT_IMPL(a, b) a##b
+#define SPROFILE_CONCAT(a, b) SPROFILE_CONCAT_IMPL(a, b)
+
+	// Define SPROFILER_DISABLE_ZONES to compile every zone out entirely
+#ifdef SPROFILER_DISABLE_ZONES
+#define SPROFILE_SCOPE(name)
+#else
+#define SPROFILE_SCOPE(name) ::SProfiler::Zone SPROFILE_CONCAT(sprofileZone, __LINE__){ name }
+#endif
+
+	// Summary of ClockStats that goes into the report. Turns sample counts into real time.
+struct SamplingStats {
+	double targetHz = 0, achievedHz = 0;
+	double meanLateMicros = 0, jitterMicros = 0, maxLateMicros = 0;
+	uint64_t taken = 0, missed = 0;
+		// Wall time each sample stands for
+	double millisPerSample = 0;
+};
+
+	// How the main thread's wall time split up, for off-CPU sampling
+struct ThreadStateSummary {
+	size_t running = 0, runnable = 0, blocked = 0;
+	double runningMillis = 0, runnableMillis = 0, blockedMillis = 0;
+};
+
+	// Blocking call site (and what it was waiting in) -> number of samples, sorted highest first
+using WaitMap = std::vector<std::pair<std::string, size_t>>;
+
+	// How much the profiler perturbed the program it measured
+struct OverheadReport {
+	double captureMicrosPerSample = 0;
+		// Share of wall time the main thread spent stalled by sample captures (upper bound)
+	double mainThreadStallPercent = 0;
+		// Capture, ring push and drain time, as a share of one core
+	double profilerCpuPercent = 0;
+		// Symbol and line lookups. Happens while reporting, not while recording.
+	double symbolizeMillis = 0;
+};
+
+	// Settings for StartCounters. Periods are in events per sample.
+struct CounterSettings {
+	bool cycles = true, cacheMisses = true, branchMisses = true;
+	uint64_t cyclePeriod = 1'000'000;
+	uint64_t cacheMissPeriod = 1'000;
+	uint64_t branchMissPeriod = 1'000;
+};
+
+	// Which event ended up backing a SampleSource. 'event' names the software
+	// fallback if the hardware counter wasn't available.
+struct CounterInfo {
+	SampleSource source;
+	const char* event;
+	bool software;
+};
+
+	// Settings for StartContinuous
+struct ContinuousSettings {
+		// How much history is kept in memory, and written out on a dump
+	std::chrono::seconds window{ 30 };
+	size_t samplesPerMilli = 1;
+
+		// How often new samples get flushed to disk
+	std::chrono::seconds flushInterval{ 5 };
+	std::string directory = ".";
+		// Flushed chunk files are reused round robin so disk usage stays bounded
+	size_t maxChunks = 16;
+};
+
 	// Holds data the profiler thread needs to store it's data
 static struct ProfilerData {
-		// The thread itself so it doesn't go out of scope
+		// The threads themselves so they don't go out of scope
 	std::thread profileThread;
+	std::thread drainThread;
+	std::thread flushThread;
 
-	std::vector<void*> addrs;
+		// Written by the profiler thread, read by the drain thread
+	internal::RingBuffer<Sample> ring;
+	std::atomic_size_t dropped = 0;
+
+		// Everything drained so far (or the last window of it in continuous mode).
+		// Allocated in Start() so draining doesn't allocate either.
+	internal::SampleWindow history;
+	std::mutex historyMutex;
 	size_t samples;
 
-		// How much time in between each sample
-	std::chrono::microseconds sleepTime;
+		// Continuous mode: record until Exit(), flushing chunks from the flush thread
+	bool continuous = false;
+
+		// Off-CPU mode: record the thread's state every tick too, so blocked time shows up
+	bool offCpu = false;
+	ContinuousSettings settings;
+	std::mutex flushMutex;
+	std::condition_variable flushSignal;
+
+		// Set by DumpWindow() or the dump signal, picked up by the flush thread
+	std::atomic_bool dumpRequested = false;
+	std::atomic<const char*> dumpReason = "";
+
+		// How much time in between each sample. Never 0, see maxSamplesPerMilli.
+	std::chrono::microseconds sleepTime{ 1000 };
+
+		// Cleared by the profiler thread once it takes its last sample
+	std::atomic_bool recording = false;
+		// Set by the drain thread once everything recorded made it into the history
+	std::atomic_bool drained = false;
 
 		// If the program exits before profiler finishes all its samples, force quit
 	std::atomic_bool forceStop = false;
 
-		// Only logs data once per "start"
+	internal::ClockStats clockStats;
+	internal::OverheadStats overhead;
+
+		// Counters opened by StartCounters, empty for timer sampling
+	std::vector<CounterInfo> counters;
+
+		// Only logs a finished recording once per "start"
 	bool hasLogged = false;
-} *data;
 
-namespace internal {
-class Logger { ... };
-} // namespace internal
+		// Address -> symbol name. Kept across reports so each address is only ever looked up once.
+		// Locked since the flush thread symbolizes too.
+	std::unordered_map<void*, std::string> symbolCache;
+	std::mutex symbolMutex;
+
+		// Address -> file:line. Only Report() touches it.
+	std::unordered_map<void*, SourceLine> lineCache;
+} *data;
 
 // Linking between windows/linux handled in a cmake program.
 
@@ -49,53 +539,823 @@ void PlatformSpecificExit();
 void* GetRip();
 // Returns the name of the function the symbol in the address holds
 std::string GetSymbolName(void* addr);
+// Sleeps until an absolute deadline, rather than for a duration, so oversleeping doesn't add up
+void SleepUntil(std::chrono::steady_clock::time_point deadline);
+// Hooks up a signal that requests a dump in continuous mode, if the platform has one
+void InstallDumpSignal();
+// Puts back whatever handled that signal before InstallDumpSignal
+void RemoveDumpSignal();
+// Opens counter overflow sampling on the main thread. Returns what could be opened, empty
+// if the platform doesn't support it.
+std::vector<CounterInfo> PlatformStartCounters(const CounterSettings& settings);
+void PlatformStopCounters();
+// Copies out up to 'max' samples the counters took since the last call
+size_t ReadCounterSamples(Sample* out, size_t max);
+// Returns the file and line for each address. Takes them all at once so a platform can
+// batch the lookups.
+std::vector<SourceLine> GetSourceLines(const std::vector<void*>& addrs);
+// Every executable mapping in the process
+std::vector<ModuleInfo> GetModules();
+// Takes an off-CPU sample: the main thread's state, plus RIP or the blocking call site
+Sample SampleThreadState();
+// Name for a Sample::waitReason
+const char* WaitReasonName(uint16_t reason);
 
 // ----- Non-platform specific functions -----
+	// Cached wrapper around GetSymbolName
+static const std::string& LookupSymbol(void* addr) {
+	std::scoped_lock lock{ data->symbolMutex };
+	auto [it, inserted] = data->symbolCache.try_emplace(addr);
+
+	if (inserted) {
+		const uint64_t start = internal::Now();
+		it->second = GetSymbolName(addr);
+		data->overhead.symbolizeTicks.fetch_add(internal::Now() - start, std::memory_order_relaxed);
+	}
+
+	return it->second;
+}
+
 	// Collect samples every so often (runs on separate thread)
 static void RecordData() {
-	for (samples) {
-			// Sleep until cooldown ends
-		std::this_thread::sleep_for(data->sleepTime);
+	using namespace std::chrono;
+
+	const nanoseconds period = data->sleepTime;
+	auto deadline = steady_clock::now();
+
+	for (size_t i = 0; data->continuous || i < data->samples; ++i) {
+			// Sleep until the next tick. Deadlines are absolute, so waking late once doesn't
+			// push every tick after it back too.
+		deadline += period;
+		SleepUntil(deadline);
 		
 		if (data->forceStop)
-			return;
+			break;
+
+		const auto woke = steady_clock::now();
+		nanoseconds late = woke - deadline;
+
+			// Woke up a whole period or more late. Skip the missed ticks instead of
+			// taking a burst of back to back samples to catch up.
+		if (late >= period) {
+			const auto missed = late / period;
+			data->clockStats.missed.fetch_add(missed, std::memory_order_relaxed);
+			deadline += missed * period;
+			late -= missed * period;
+		}
+
+		data->clockStats.Add(woke, late);
+
+			// Add next RIP sample. Never blocks, a full ring just drops the sample.
+		const uint64_t captureStart = internal::Now();
+		const Sample sample = data->offCpu ? SampleThreadState() : Sample{ GetRip(), internal::Now() };
+		const uint64_t captureEnd = internal::Now();
+
+		if (!data->ring.Push(sample))
+			data->dropped.fetch_add(1, std::memory_order_relaxed);
+
+		data->overhead.captureTicks.fetch_add(captureEnd - captureStart, std::memory_order_relaxed);
+		data->overhead.pushTicks.fetch_add(internal::Now() - captureEnd, std::memory_order_relaxed);
+		data->overhead.captures.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	data->overhead.stopTick = internal::Now();
+	data->recording = false;
+}
+
+	// Collects counter overflow samples instead of timer samples (runs on separate thread)
+static void RecordCounters() {
+	Sample batch[256];
+	size_t taken = 0;
+
+	while (!data->forceStop && (data->continuous || taken < data->samples)) {
+		std::this_thread::sleep_for(internal::counterPollInterval);
+
+		const size_t max = data->continuous ? std::size(batch) : std::min(std::size(batch), data->samples - taken);
+		const uint64_t captureStart = internal::Now();
+		const size_t count = ReadCounterSamples(batch, max);
+
+		for (size_t i = 0; i < count; ++i) {
+			if (!data->ring.Push(batch[i]))
+				data->dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+
+			// The kernel takes these samples, so reading them doesn't stall the main thread
+		data->overhead.pushTicks.fetch_add(internal::Now() - captureStart, std::memory_order_relaxed);
+		data->overhead.captures.fetch_add(count, std::memory_order_relaxed);
+		taken += count;
+	}
+
+	PlatformStopCounters();
+	data->overhead.stopTick = internal::Now();
+	data->recording = false;
+}
+
+	// Moves samples out of the ring buffer into the history (runs on separate thread)
+static void DrainData() {
+	Sample batch[256];
+
+	while (data->recording || !data->ring.Empty()) {
+		const size_t count = data->ring.PopBulk(batch, std::size(batch));
+
+		if (count == 0) {
+			std::this_thread::sleep_for(internal::drainInterval);
+			continue;
+		}
+
+		const uint64_t start = internal::Now();
+		{
+			std::scoped_lock lock{ data->historyMutex };
+			data->history.Append(batch, count);
+		}
+		data->overhead.drainTicks.fetch_add(internal::Now() - start, std::memory_order_relaxed);
+	}
+
+	data->drained = true;
+	data->flushSignal.notify_one();
+}
+
+	// Writes every sample numbered 'first' or later that's still in memory to a compressed
+	// chunk file. Returns the number to start from next time.
+	//
+	// Chunk layout (all integers LEB128):
+	//   "SPRC" version reason-length reason ticks-per-micro(raw double)
+	//   address-count { address name-length name }...
+	//   sample-count first-tick { address-index tick-delta kind }...
+	// Each unique address and its name is stored once, samples only reference it by index.
+	// 'kind' is a single byte, source << 4 | thread state. Version 1 chunks don't have it.
+static uint64_t WriteChunk(const std::string& fname, uint64_t first, std::string_view reason) {
+	std::vector<Sample> samples;
+	uint64_t end = 0;
+	{
+		std::scoped_lock lock{ data->historyMutex };
+		data->history.CopySince(first, samples);
+		end = data->history.Total();
+	}
+
+	if (samples.empty())
+		return end;
+
+	std::unordered_map<void*, uint64_t> addrIndex;
+	std::vector<void*> addrs;
+	std::string body;
+	uint64_t prevTick = samples.front().tick;
+
+	for (const Sample& sample : samples) {
+		auto [it, inserted] = addrIndex.try_emplace(sample.rip, addrs.size());
+		if (inserted)
+			addrs.push_back(sample.rip);
+
+		internal::PutVarint(body, it->second);
+		internal::PutVarint(body, sample.tick - prevTick);
+		body += static_cast<char>(static_cast<uint8_t>(sample.source) << 4 | static_cast<uint8_t>(sample.state));
+		prevTick = sample.tick;
+	}
+
+	std::string chunk = "SPRC";
+	internal::PutVarint(chunk, 2);
+	internal::PutVarint(chunk, reason.size());
+	chunk += reason;
+	chunk.append(reinterpret_cast<const char*>(&internal::ticksPerMicro), sizeof(double));
+
+	internal::PutVarint(chunk, addrs.size());
+	for (void* addr : addrs) {
+		const std::string& name = LookupSymbol(addr);
+
+		internal::PutVarint(chunk, reinterpret_cast<uintptr_t>(addr));
+		internal::PutVarint(chunk, name.size());
+		chunk += name;
+	}
+
+	internal::PutVarint(chunk, samples.size());
+	internal::PutVarint(chunk, samples.front().tick);
+	chunk += body;
+
+	std::ofstream out{ fname, std::ios::binary };
+	out.write(chunk.data(), chunk.size());
+
+	return end;
+}
+
+	// Periodically writes new samples to disk and handles dump requests (runs on separate thread)
+static void FlushData() {
+	const ContinuousSettings& settings = data->settings;
+	uint64_t flushed = 0;
+	size_t chunkCount = 0, dumpCount = 0;
+	auto nextFlush = std::chrono::steady_clock::now() + settings.flushInterval;
+
+	std::unique_lock lock{ data->flushMutex };
+	while (!data->drained) {
+		data->flushSignal.wait_for(lock, internal::dumpPollInterval);
+
+			// Dumps take the whole window, not just what's new since the last flush
+		if (data->dumpRequested.exchange(false)) {
+			const std::string fname = settings.directory + "/sprofile_dump_" + std::to_string(dumpCount++) + ".sprc";
+			WriteChunk(fname, 0, data->dumpReason.load());
+		}
+
+		if (std::chrono::steady_clock::now() >= nextFlush) {
+			const std::string fname = settings.directory + "/sprofile_" + std::to_string(chunkCount++ % settings.maxChunks) + ".sprc";
+			flushed = WriteChunk(fname, flushed, "flush");
+			nextFlush += settings.flushInterval;
+		}
+	}
+
+		// Don't lose whatever came in after the last flush
+	const std::string fname = settings.directory + "/sprofile_" + std::to_string(chunkCount % settings.maxChunks) + ".sprc";
+	WriteChunk(fname, flushed, "exit");
+}
+
+	// Stops the current recording, if any, and waits for its threads to finish. The next
+	// Start* resets the buffers those threads write to, so they can't still be running.
+static void StopRecording() {
+	data->forceStop = true;
+	data->flushSignal.notify_one();
+
+	if (data->profileThread.joinable())
+		data->profileThread.join();
+	if (data->drainThread.joinable())
+		data->drainThread.join();
+	if (data->flushThread.joinable())
+		data->flushThread.join();
+}
+
+	// Init data needed for profiler to run. Call from the thread that should be sampled.
+void Init() {
+	PlatformSpecificInit();
+	data = new ProfilerData;
+
+	internal::zoneRegistry.mainThread = std::this_thread::get_id();
+	internal::CalibrateTicks();
+}
+	// Start recording the program. records 'numSamples' samples.
+	// With 'offCpu' every tick also records whether the thread was running, waiting for a
+	// core, or blocked (and where), so time lost to locks, I/O and sleeps shows up too.
+void Start(size_t numSamples = ..., size_t samplesPerMilli = ..., bool offCpu = false) {
+	StopRecording();
+
+		// Reset params for data
+	...
+	data->sleepTime = std::chrono::microseconds(1000) / std::clamp<size_t>(samplesPerMilli, 1, internal::maxSamplesPerMilli);
+	data->forceStop = false;
+	data->hasLogged = false;
+
+		// Allocate everything the profiler and drain threads write to before they start
+	data->continuous = false;
+	data->offCpu = offCpu;
+	data->counters.clear();
+	data->ring.Reset(internal::ringCapacity);
+	data->dropped = 0;
+	data->clockStats.Reset();
+	data->overhead.Reset(internal::Now());
+	data->history.Reset(numSamples, false);
+	data->recording = true;
+	data->drained = false;
+
+		// Init new threads
+	data->profileThread = std::thread(RecordData);
+	data->drainThread = std::thread(DrainData);
+}
+	// Start recording until Exit(), keeping only the last 'settings.window' of samples in memory.
+	// New samples are flushed to disk every so often, and DumpWindow() writes out the whole window.
+void StartContinuous(const ContinuousSettings& settings = {}) {
+	using namespace std::chrono;
+
+	StopRecording();
+
+	data->continuous = true;
+	data->offCpu = false;
+	data->counters.clear();
+	data->settings = settings;
+	data->settings.maxChunks = std::max<size_t>(settings.maxChunks, 1);
+	data->settings.samplesPerMilli = std::clamp<size_t>(settings.samplesPerMilli, 1, internal::maxSamplesPerMilli);
+	data->sleepTime = duration_cast<microseconds>(milliseconds(1)) / data->settings.samplesPerMilli;
+	data->forceStop = false;
+	data->hasLogged = false;
+	data->dumpRequested = false;
+
+	data->ring.Reset(internal::ringCapacity);
+	data->dropped = 0;
+	data->clockStats.Reset();
+	data->overhead.Reset(internal::Now());
+	data->history.Reset(duration_cast<milliseconds>(settings.window).count() * data->settings.samplesPerMilli, true);
+	data->recording = true;
+	data->drained = false;
+
+	InstallDumpSignal();
+
+	data->profileThread = std::thread(RecordData);
+	data->drainThread = std::thread(DrainData);
+	data->flushThread = std::thread(FlushData);
+}
+	// Writes the current window to disk, e.g. when the program notices a latency spike.
+	// Only does anything in continuous mode. 'reason' has to outlive the dump, literals are expected.
+void DumpWindow(const char* reason = "api") {
+	data->dumpReason = reason;
+	data->dumpRequested = true;
+	data->flushSignal.notify_one();
+}
+	// Saves every sample recorded so far in the chunk format, e.g. as input for ProfileDiff
+void SaveSamples(const char* fname) {
+	WriteChunk(fname, 0, "save");
+}
+	// Like Start(), but samples every time a hardware counter overflows instead of on a timer.
+	// Shows whether hot code is stalling on memory (cache misses), mispredicting branches,
+	// or just burning cycles. Returns false if no counter could be opened.
+bool StartCounters(size_t numSamples = ..., const CounterSettings& settings = {}) {
+	StopRecording();
+
+	data->counters = PlatformStartCounters(settings);
+	if (data->counters.empty())
+		return false;
+
+	data->samples = numSamples;
+	data->continuous = false;
+	data->offCpu = false;
+	data->forceStop = false;
+	data->hasLogged = false;
+
+	data->ring.Reset(internal::ringCapacity);
+	data->dropped = 0;
+	data->clockStats.Reset();
+	data->overhead.Reset(internal::Now());
+	data->history.Reset(numSamples, false);
+	data->recording = true;
+	data->drained = false;
+
+	data->profileThread = std::thread(RecordCounters);
+	data->drainThread = std::thread(DrainData);
+	return true;
+}
+	// How much the profiler itself cost so far
+OverheadReport GetOverhead() {
+	const internal::OverheadStats& overhead = data->overhead;
+	const double toMicros = 1 / internal::ticksPerMicro;
+	OverheadReport report;
+
+	const uint64_t stop = overhead.stopTick ? overhead.stopTick.load() : internal::Now();
+	const double wallMicros = (stop - overhead.startTick) * toMicros;
+	const double captureMicros = overhead.captureTicks * toMicros;
+	const double busyMicros = captureMicros + (overhead.pushTicks + overhead.drainTicks) * toMicros;
+
+	if (overhead.captures > 0)
+		report.captureMicrosPerSample = captureMicros / overhead.captures;
+
+	if (wallMicros > 0) {
+		report.mainThreadStallPercent = 100 * captureMicros / wallMicros;
+		report.profilerCpuPercent = 100 * busyMicros / wallMicros;
+	}
+
+	report.symbolizeMillis = overhead.symbolizeTicks * toMicros / 1e3;
+	return report;
+}
+	// How closely the profiler kept to the requested rate so far
+SamplingStats GetSamplingStats() {
+	const internal::ClockStats& clock = data->clockStats;
+	SamplingStats stats;
+
+	stats.taken = clock.taken;
+	stats.missed = clock.missed;
+	stats.targetHz = 1e6 / data->sleepTime.count();
+
+	if (stats.taken == 0)
+		return stats;
+
+	const double n = static_cast<double>(stats.taken);
+	const double meanNs = clock.sumLateNs / n;
+	const double elapsedMs = (clock.lastNs - clock.firstNs) / 1e6;
+
+	stats.meanLateMicros = meanNs / 1e3;
+	stats.jitterMicros = std::sqrt(std::max(clock.sumLateSqNs / n - meanNs * meanNs, 0.0)) / 1e3;
+	stats.maxLateMicros = clock.maxLateNs / 1e3;
+
+	if (stats.taken > 1) {
+		stats.achievedHz = (n - 1) / (elapsedMs / 1e3);
+		stats.millisPerSample = elapsedMs / (n - 1);
+	}
+
+	return stats;
+}
+
+	// Sample counts per function, for samples from one source
+static HeatMap BuildHeatMap(const std::vector<Sample>& samples, SampleSource source) {
+		// Long runs hit the same few thousand addresses millions of times, so count
+		// them first and only symbolize each unique address once
+	std::unordered_map<void*, size_t> addrCounts;
+	for (const Sample& sample : samples) {
+		if (sample.source == source && sample.state != ThreadState::Blocked)
+			++addrCounts[sample.rip];
+	}
+
+		// Different addresses in the same function get merged here. The names are owned
+		// by the symbol cache, which outlives the heat map.
+	std::unordered_map<std::string_view, size_t> functionCounts;
+	for (const auto& [addr, count] : addrCounts) {
+		const std::string& name = LookupSymbol(addr);
+
+		if (!name.empty())
+			functionCounts[name] += count;
+	}
+
+	HeatMap heatMap{ functionCounts.begin(), functionCounts.end() };
+	std::sort(heatMap.begin(), heatMap.end(),
+		[](const auto& a, const auto& b) { return a.second > b.second; });
+
+	return heatMap;
+}
+
+	// Where blocked samples were waiting, grouped by call site and system call
+static WaitMap BuildWaitMap(const std::vector<Sample>& samples) {
+	std::unordered_map<std::string, size_t> counts;
+
+	for (const Sample& sample : samples) {
+		if (sample.state != ThreadState::Blocked)
+			continue;
+
+		const std::string& site = LookupSymbol(sample.rip);
+		++counts[(site.empty() ? "[unknown]" : site) + " (" + WaitReasonName(sample.waitReason) + ')'];
+	}
+
+	WaitMap waitMap{ counts.begin(), counts.end() };
+	std::sort(waitMap.begin(), waitMap.end(),
+		[](const auto& a, const auto& b) { return a.second > b.second; });
+
+	return waitMap;
+}
+
+	// Counts off-CPU samples by state, and converts them to wall time
+static ThreadStateSummary SummarizeThreadStates(const std::vector<Sample>& samples) {
+	ThreadStateSummary summary;
+
+	for (const Sample& sample : samples) {
+		switch (sample.state) {
+		case ThreadState::Running: ++summary.running; break;
+		case ThreadState::Runnable: ++summary.runnable; break;
+		case ThreadState::Blocked: ++summary.blocked; break;
+		default: break;
+		}
+	}
+
+	const double millisPerSample = GetSamplingStats().millisPerSample;
+	summary.runningMillis = summary.running * millisPerSample;
+	summary.runnableMillis = summary.runnable * millisPerSample;
+	summary.blockedMillis = summary.blocked * millisPerSample;
+
+	return summary;
+}
+
+	// Reads the given lines out of a source file, if it can be found. Returned in the same order.
+static std::vector<std::string> ReadSourceLines(const std::string& fname, const std::vector<unsigned>& lines) {
+	std::vector<std::string> result(lines.size());
+	std::ifstream file{ fname };
+	if (!file)
+		return result;
+
+	std::string text;
+	unsigned current = 0;
+	for (size_t i = 0; i < lines.size() && std::getline(file, text);) {
+		++current;
+
+		for (; i < lines.size() && lines[i] <= current; ++i) {
+			if (lines[i] == current)
+				result[i] = text;
+		}
+	}
+
+	return result;
+}
+
+	// Makes sure every address is in the line cache, looking up the missing ones in one batch
+static void CacheSourceLines(const std::vector<void*>& addrs) {
+	std::vector<void*> missing;
+	for (void* addr : addrs) {
+		if (!data->lineCache.contains(addr))
+			missing.push_back(addr);
+	}
+
+	if (missing.empty())
+		return;
+
+	const uint64_t start = internal::Now();
+	std::vector<SourceLine> found = GetSourceLines(missing);
+	data->overhead.symbolizeTicks.fetch_add(internal::Now() - start, std::memory_order_relaxed);
+
+	for (size_t i = 0; i < missing.size(); ++i)
+		data->lineCache.emplace(missing[i], std::move(found[i]));
+}
+
+	// Breaks the hottest functions in a heat map down by source line
+static std::vector<AnnotatedFunction> AnnotateHottest(const std::vector<Sample>& samples,
+	SampleSource source, const HeatMap& heatMap)
+{
+	const size_t count = std::min(heatMap.size(), internal::annotatedFunctions);
+	std::unordered_map<std::string_view, size_t> hotIndex;
+	for (size_t i = 0; i < count; ++i)
+		hotIndex.emplace(heatMap[i].first, i);
+
+		// Count per address first, like BuildHeatMap, so each unique address is symbolized once
+	std::unordered_map<void*, size_t> addrCounts;
+	for (const Sample& sample : samples) {
+		if (sample.source == source && sample.state != ThreadState::Blocked)
+			++addrCounts[sample.rip];
+	}
+
+		// Only the addresses inside the hot functions need line info
+	std::vector<void*> addrs;
+	for (auto it = addrCounts.begin(); it != addrCounts.end();) {
+		if (hotIndex.contains(LookupSymbol(it->first))) {
+			addrs.push_back(it->first);
+			++it;
+		}
+		else {
+			it = addrCounts.erase(it);
+		}
+	}
+
+	CacheSourceLines(addrs);
+
+		// Merge addresses on the same line. Inlined header code can bring the same line number
+		// in from another file, so the file is part of the key. Kept sorted by file, then line.
+	using LineKey = std::pair<std::string_view, unsigned>;
+	std::vector<std::map<LineKey, AnnotatedLine>> perLine(count);
+	for (const auto& [addr, hits] : addrCounts) {
+		const SourceLine& line = data->lineCache.at(addr);
+		auto [it, inserted] = perLine[hotIndex.at(LookupSymbol(addr))].try_emplace(LineKey{ line.file, line.line }, AnnotatedLine{ line, 0, {} });
+		it->second.samples += hits;
+	}
+
+	std::vector<AnnotatedFunction> result;
+	for (size_t i = 0; i < count; ++i) {
+		AnnotatedFunction& function = result.emplace_back(AnnotatedFunction{ heatMap[i].first, heatMap[i].second, {} });
+
+		for (auto& [key, line] : perLine[i])
+			function.lines.push_back(std::move(line));
+
+			// Lines from the same file are next to each other, so each file only gets read once
+		for (size_t first = 0; first < function.lines.size();) {
+			const std::string& fname = function.lines[first].source.file;
+			std::vector<unsigned> numbers;
+			size_t last = first;
+			for (; last < function.lines.size() && function.lines[last].source.file == fname; ++last)
+				numbers.push_back(function.lines[last].source.line);
+
+			std::vector<std::string> text = ReadSourceLines(fname, numbers);
+			for (size_t j = first; j < last; ++j)
+				function.lines[j].text = std::move(text[j - first]);
+
+			first = last;
+		}
+	}
+
+	return result;
+}
+
+	// Manually logs data collected to a file. Can be called while still recording.
+void Report() {
+		// Read before the copy. If everything was drained by then, the copy is complete.
+	const bool finished = data->drained;
+
+		// Copy what has been drained so far, so symbol lookups don't hold up the drain thread
+	std::vector<Sample> snapshot;
+	{
+		std::scoped_lock lock{ data->historyMutex };
+		data->history.CopySince(0, snapshot);
+	}
+
+	internal::Logger log{ file };
+
+		// One heat map per event, so cycles can be compared against cache and branch misses
+	for (size_t i = 0; i < static_cast<size_t>(SampleSource::Count); ++i) {
+		const auto source = static_cast<SampleSource>(i);
+		const HeatMap heatMap = BuildHeatMap(snapshot, source);
+
+		if (!heatMap.empty()) {
+			log.Log(SourceName(source), heatMap, ...);
+			log.Log(SourceName(source), AnnotateHottest(snapshot, source, heatMap), ...);
+		}
+	}
+
+		// Off-CPU time goes right next to the on-CPU heat map
+	if (data->offCpu)
+		log.Log(SummarizeThreadStates(snapshot), BuildWaitMap(snapshot), ...);
+
+	log.Log(GetSamplingStats(), GetOverhead(), data->counters, snapshot.size(), data->dropped, ...);
+
+		// A progress report taken mid-run doesn't stop Exit() from logging the full profile
+	if (finished)
+		data->hasLogged = true;
+}
+	// Turns SPROFILE_SCOPE recording on or off. Zones are off until this is called.
+void EnableZones(bool enable = true) {
+	internal::zonesEnabled = enable;
+}
+
+	// Writes a quoted JSON string, escaping anything that would break the trace file
+static void WriteJsonString(std::ostream& out, std::string_view str) {
+	out << '"';
+	for (char c : str) {
+		if (c == '"' || c == '\\')
+			out << '\\';
+
+		if (static_cast<unsigned char>(c) >= 0x20)
+			out << c;
+	}
+	out << '"';
+}
+
+	// Exports every zone recorded so far plus the RIP samples to the Chrome trace event format.
+	// Open it in chrome://tracing or ui.perfetto.dev. Samples show up as instant events on the
+	// main thread's track, so they line up with whatever zone was open at the time.
+void WriteChromeTrace(const char* fname) {
+	std::vector<Sample> snapshot;
+	{
+		std::scoped_lock lock{ data->historyMutex };
+		data->history.CopySince(0, snapshot);
+	}
+
+	std::scoped_lock lock{ internal::zoneRegistry.mutex };
+	const auto& buffers = internal::zoneRegistry.buffers;
+
+		// Trace timestamps start at the earliest thing recorded
+	uint64_t base = UINT64_MAX;
+	for (const Sample& sample : snapshot)
+		base = std::min(base, sample.tick);
+	for (const auto& zones : buffers) {
+		if (zones->count > 0)
+			base = std::min(base, zones->events[0].begin);
+	}
+
+	const auto toMicro = [base](uint64_t tick) { return (tick - base) / internal::ticksPerMicro; };
+
+	std::ofstream out{ fname };
+	out << std::fixed << std::setprecision(3);
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	out << R"({"name":"thread_name","ph":"M","pid":1,"tid":0,"args":{"name":"main"}})";
+
+	for (const auto& zones : buffers) {
+		const size_t count = zones->count.load(std::memory_order_acquire);
+
+		for (size_t i = 0; i < count; ++i) {
+			const internal::ZoneEvent& zone = zones->events[i];
+
+			out << ",\n{\"name\":";
+			WriteJsonString(out, zone.name);
+			out << ",\"cat\":\"zone\",\"ph\":\"X\",\"pid\":1,\"tid\":" << zones->threadId
+				<< ",\"ts\":" << toMicro(zone.begin)
+				<< ",\"dur\":" << (zone.end - zone.begin) / internal::ticksPerMicro << '}';
+		}
+	}
+
+	for (const Sample& sample : snapshot) {
+		out << ",\n{\"name\":";
+		WriteJsonString(out, LookupSymbol(sample.rip));
+		out << ",\"cat\":\"" << SourceName(sample.source) << "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":0,\"ts\":"
+			<< toMicro(sample.tick) << '}';
+	}
+
+	out << "\n]}\n";
+}
+
+	// Exports the samples as a pprof profile (profile.proto), so `pprof` and anything else that
+	// reads the format can open it. Written uncompressed, pprof accepts that as is (gzip it for
+	// tools that insist). There are no call stacks, each sample is a single location.
+	// One sample type per source that has samples, e.g. "timer" and "cycles" side by side.
+void WritePprof(const char* fname) {
+	std::vector<Sample> snapshot;
+	{
+		std::scoped_lock lock{ data->historyMutex };
+		data->history.CopySince(0, snapshot);
+	}
+
+		// Identical samples are merged, the value counts them instead
+	std::vector<SampleSource> sources;
+	std::unordered_map<void*, std::vector<uint64_t>> addrCounts;
+	for (const Sample& sample : snapshot) {
+		if (sample.state == ThreadState::Blocked)
+			continue;
+
+		auto slot = std::find(sources.begin(), sources.end(), sample.source);
+		if (slot == sources.end())
+			slot = sources.insert(sources.end(), sample.source);
+
+		std::vector<uint64_t>& counts = addrCounts[sample.rip];
+		counts.resize(static_cast<size_t>(SampleSource::Count));
+		++counts[slot - sources.begin()];
+	}
+
+	std::vector<void*> addrs;
+	for (const auto& [addr, counts] : addrCounts)
+		addrs.push_back(addr);
+
+	CacheSourceLines(addrs);
+
+		// Index 0 has to be the empty string
+	std::vector<std::string_view> strings{ "" };
+	std::unordered_map<std::string_view, uint64_t> stringIds{ { "", 0 } };
+	const auto stringId = [&](std::string_view str) {
+		auto [it, inserted] = stringIds.try_emplace(str, strings.size());
+		if (inserted)
+			strings.push_back(str);
+
+		return it->second;
+	};
+
+	internal::ProtoWriter profile;
 
-			// Add next RIP sample
-		data->addrs.push_back(GetRip());
+	for (SampleSource source : sources) {
+		internal::ProtoWriter valueType;
+		valueType.Varint(1, stringId(SourceName(source)));
+		valueType.Varint(2, stringId("count"));
+		profile.Message(1, valueType);
 	}
-} 
 
-	// Init data needed for profiler to run
-void Init() {
-	PlatformSpecificInit();
-	data = new ProfilerData;
-}
-	// Start recording the program. records 'numSamples' samples
-void Start(size_t numSamples = ..., size_t samplesPerMilli = ...) {
-		// Reset params for data
-	...
-		// Init new thread
-	data->profileThread = std::thread(RecordData);
-}
-	// Manually logs data collected to a file
-void Report() {
-		// Wait for data gathering to finish
-	data->profileThread.join();
+		// Mappings, ids start at 1
+	const std::vector<ModuleInfo> modules = GetModules();
+	for (size_t i = 0; i < modules.size(); ++i) {
+		internal::ProtoWriter mapping;
+		mapping.Varint(1, i + 1);
+		mapping.Varint(2, modules[i].begin);
+		mapping.Varint(3, modules[i].end);
+		mapping.Varint(4, modules[i].offset);
+		mapping.Varint(5, stringId(modules[i].path));
+		mapping.Varint(7, 1);	// has_functions
+		mapping.Varint(8, 1);	// has_filenames
+		mapping.Varint(9, 1);	// has_line_numbers
+		profile.Message(3, mapping);
+	}
+
+	std::unordered_map<std::string_view, uint64_t> functionIds;
+	for (size_t i = 0; i < addrs.size(); ++i) {
+		const auto a = reinterpret_cast<uintptr_t>(addrs[i]);
+		const std::string_view name = LookupSymbol(addrs[i]);
+		const SourceLine& line = data->lineCache.at(addrs[i]);
+
+		auto [function, isNew] = functionIds.try_emplace(name.empty() ? "[unknown]" : name, functionIds.size() + 1);
+		if (isNew) {
+			internal::ProtoWriter func;
+			func.Varint(1, function->second);
+			func.Varint(2, stringId(function->first));
+			func.Varint(3, stringId(function->first));
+			func.Varint(4, stringId(line.file));
+			profile.Message(5, func);
+		}
+
+		internal::ProtoWriter location;
+		location.Varint(1, i + 1);
+
+		auto module = std::find_if(modules.begin(), modules.end(),
+			[a](const ModuleInfo& m) { return a >= m.begin && a < m.end; });
+		if (module != modules.end())
+			location.Varint(2, module - modules.begin() + 1);
+
+		location.Varint(3, a);
+
+		internal::ProtoWriter locationLine;
+		locationLine.Varint(1, function->second);
+		locationLine.Varint(2, line.line);
+		location.Message(4, locationLine);
+		profile.Message(4, location);
 
-	create heat map of data
-	for (addr in data->addrs) {
-		if (GetSymbolName(addr) != "")
-			add data to heat map
+		internal::ProtoWriter sample;
+		sample.Packed(1, { i + 1 });
+		std::vector<uint64_t> values = addrCounts.at(addrs[i]);
+		values.resize(sources.size());
+		sample.Packed(2, values);
+		profile.Message(2, sample);
 	}
 
-	internal::Logger log{ file };
-	log.Log(heat map, ...);
+	const SamplingStats stats = GetSamplingStats();
+	profile.Varint(9, std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count());
+	profile.Varint(10, static_cast<uint64_t>(stats.millisPerSample * stats.taken * 1e6));
+
+	internal::ProtoWriter periodType;
+	periodType.Varint(1, stringId("wall"));
+	periodType.Varint(2, stringId("nanoseconds"));
+	profile.Message(11, periodType);
+	profile.Varint(12, std::chrono::nanoseconds(data->sleepTime).count());
+
+		// Strings last, everything above had to be written to know what's in the table
+	for (std::string_view str : strings)
+		profile.Bytes(6, str);
+
+	std::ofstream out{ fname, std::ios::binary };
+	out.write(profile.Data().data(), profile.Data().size());
 }
+
 	// Cleansup all profiler data. also reports data collected so far if it hasn't finished
 void Exit() {
+	StopRecording();
+	RemoveDumpSignal();
+
 		// Properly log and cleanup
-	...
-	delete data;
+	if (!data->hasLogged)
+		Report();
+
+		// Cleared first so a signal that comes in during teardown sees no data rather than freed data
+	ProfilerData* old = data;
+	data = nullptr;
+	delete old;
 
 	PlatformSpecificExit();
 }
@@ -149,6 +1409,96 @@ void* GetRip() {
 	return rip;
 }
 
+	// No signal worth using here, DumpWindow() has to be called directly
+void InstallDumpSignal() {}
+void RemoveDumpSignal() {}
+
+	// Counter sampling needs a kernel driver (or ETW with admin rights) on Windows
+std::vector<CounterInfo> PlatformStartCounters(const CounterSettings&) { return {}; }
+void PlatformStopCounters() {}
+size_t ReadCounterSamples(Sample*, size_t) { return 0; }
+
+	// Sleep() only has ~1ms resolution, so wait on a high resolution timer for most of the
+	// time left and spin through the rest
+void SleepUntil(std::chrono::steady_clock::time_point deadline) {
+	using namespace std::chrono;
+	constexpr auto spinTime = microseconds(50);
+
+		// One timer per sampling thread, closed when the thread exits
+	struct WaitableTimer {
+		HANDLE handle = CreateWaitableTimerExW(nullptr, nullptr,
+			CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+		~WaitableTimer() {
+			if (handle)
+				CloseHandle(handle);
+		}
+	};
+	thread_local WaitableTimer timer;
+
+	const auto remaining = deadline - steady_clock::now() - spinTime;
+	if (remaining > nanoseconds::zero()) {
+			// Negative due time means relative, in 100ns units
+		LARGE_INTEGER due{};
+		due.QuadPart = -duration_cast<duration<long long, std::ratio<1, 10'000'000>>>(remaining).count();
+
+		SetWaitableTimerEx(timer.handle, &due, 0, nullptr, nullptr, nullptr, 0);
+		WaitForSingleObject(timer.handle, INFINITE);
+	}
+
+	while (steady_clock::now() < deadline)
+		YieldProcessor();
+}
+
+	// A thread that used fewer cycles than this since the last tick is treated as blocked
+constexpr ULONG64 blockedCycleThreshold = 10'000;
+
+	// Windows doesn't expose a thread's scheduler state cheaply, so this goes by how many
+	// cycles it used since the last tick. Can't tell runnable apart from running.
+Sample SampleThreadState() {
+	static ULONG64 lastCycles = 0;
+
+	ULONG64 cycles = 0;
+	QueryThreadCycleTime(mainThread, &cycles);
+	const ULONG64 used = cycles - lastCycles;
+	lastCycles = cycles;
+
+		// A thread stuck in a wait is suspended inside the ntdll stub it's waiting in
+		// (NtWaitForSingleObject, NtDelayExecution, ...), so RIP is the call site either way
+	Sample sample{ GetRip(), internal::Now() };
+	sample.state = used < blockedCycleThreshold ? ThreadState::Blocked : ThreadState::Running;
+	return sample;
+}
+
+	// The RIP symbol already names the wait function
+const char* WaitReasonName(uint16_t) { return "wait"; }
+
+std::vector<ModuleInfo> GetModules() {
+	std::vector<ModuleInfo> modules;
+
+	EnumerateLoadedModules64(process, [](PCSTR name, DWORD64 base, ULONG size, PVOID user) -> BOOL {
+		static_cast<std::vector<ModuleInfo>*>(user)->push_back(ModuleInfo{ base, base + size, 0, name });
+		return TRUE;
+	}, &modules);
+
+	return modules;
+}
+
+	// SymSetOptions needs SYMOPT_LOAD_LINES for this
+std::vector<SourceLine> GetSourceLines(const std::vector<void*>& addrs) {
+	std::vector<SourceLine> result(addrs.size());
+
+	for (size_t i = 0; i < addrs.size(); ++i) {
+		IMAGEHLP_LINE64 line{ sizeof(IMAGEHLP_LINE64) };
+		DWORD displacement = 0;
+
+		if (SymGetLineFromAddr64(process, reinterpret_cast<DWORD64>(addrs[i]), &displacement, &line))
+			result[i] = SourceLine{ line.FileName, line.LineNumber };
+	}
+
+	return result;
+}
+
 	// Get name of symbol from an address
 std::string GetSymbolName(void* addr) {
 	PSYMBOL_INFO symbol = ...;
@@ -164,3 +1514,734 @@ std::string GetSymbolName(void* addr) {
 }
 
 } // namespace SProfiler
+
+
+// ----- Linux Implementation -----
+#include <cxxabi.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+namespace SProfiler {
+
+	// Address range of one function symbol, already relocated to where it was loaded
+struct SymbolRange {
+	uintptr_t begin, end;
+	std::string name;
+};
+
+	// Sorted by 'begin'. Loaded once in PlatformSpecificInit so lookups are a binary search.
+static std::vector<SymbolRange> symbols;
+
+	// An executable mapping of an ELF file. 'bias' turns addresses back into file addresses.
+struct Module {
+	uintptr_t begin, end, offset;
+	std::string path;
+	uintptr_t bias = 0;
+};
+
+static std::vector<Module> modules;
+
+	// Addresses handed to a single addr2line run, keeps the command line a sane length
+constexpr size_t addr2lineBatch = 256;
+
+static pid_t mainThread = 0;
+static int ripSignal = 0;
+
+	// Filled in by the main thread's signal handler, read by the profiler thread.
+	// sem_post is async signal safe, and blocking on it (rather than spinning) lets the
+	// main thread run the handler right away on machines with few cores.
+static std::atomic<void*> sampledRip = nullptr;
+static sem_t ripReady;
+
+	// Give up on a sample if the main thread doesn't respond in time (signals blocked, etc.)
+constexpr std::chrono::milliseconds ripTimeout{ 5 };
+
+	// kill -USR2 <pid> dumps the current window in continuous mode. Only touches lock free
+	// atomics, the flush thread notices the request on its next poll.
+static void DumpSignalHandler(int) {
+	if (data) {
+		data->dumpReason.store("signal", std::memory_order_relaxed);
+		data->dumpRequested.store(true, std::memory_order_release);
+	}
+}
+
+	// steady_clock is CLOCK_MONOTONIC on Linux, so the deadline can be handed over directly
+void SleepUntil(std::chrono::steady_clock::time_point deadline) {
+	const auto ns = deadline.time_since_epoch().count();
+	const timespec ts{ static_cast<time_t>(ns / 1'000'000'000), static_cast<long>(ns % 1'000'000'000) };
+
+		// Restart if a signal (like the dump signal) interrupts the sleep
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+}
+
+	// The host program might use SIGUSR2 itself, so its handler goes back on Exit()
+static struct sigaction previousDumpAction;
+static bool dumpSignalInstalled = false;
+
+void InstallDumpSignal() {
+		// Another continuous run would save our own handler as the previous one
+	if (dumpSignalInstalled)
+		return;
+
+	struct sigaction action{};
+	action.sa_handler = DumpSignalHandler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+
+	dumpSignalInstalled = sigaction(SIGUSR2, &action, &previousDumpAction) == 0;
+}
+
+void RemoveDumpSignal() {
+	if (!dumpSignalInstalled)
+		return;
+
+	sigaction(SIGUSR2, &previousDumpAction, nullptr);
+	dumpSignalInstalled = false;
+}
+
+static void RipHandler(int, siginfo_t*, void* context) {
+	const auto* uc = static_cast<const ucontext_t*>(context);
+
+	sampledRip.store(reinterpret_cast<void*>(uc->uc_mcontext.gregs[REG_RIP]), std::memory_order_relaxed);
+	sem_post(&ripReady);
+}
+
+	// Adds every function symbol in the ELF file at 'path' to the symbol table.
+	// 'mapStart' is the address its offset 0 was mapped to. Returns the load bias.
+static uintptr_t LoadElfSymbols(const std::string& path, uintptr_t mapStart) {
+	const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	struct stat st{};
+	void* file = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(Elf64_Ehdr)))
+		file = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (file == MAP_FAILED)
+		return 0;
+
+	const auto* base = static_cast<const char*>(file);
+	const auto* ehdr = reinterpret_cast<const Elf64_Ehdr*>(base);
+
+	if (std::memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+		munmap(file, st.st_size);
+		return 0;
+	}
+
+		// The first PT_LOAD segment starts at file offset 0, so the difference between where
+		// it was mapped and where it asked to be is the load bias (0 for non-PIE executables).
+	const auto* phdrs = reinterpret_cast<const Elf64_Phdr*>(base + ehdr->e_phoff);
+	uintptr_t bias = 0;
+	for (int i = 0; i < ehdr->e_phnum; ++i) {
+		if (phdrs[i].p_type == PT_LOAD) {
+			bias = mapStart - (phdrs[i].p_vaddr - phdrs[i].p_offset);
+			break;
+		}
+	}
+
+		// Prefer the full symbol table, stripped binaries only have the dynamic one
+	const auto* shdrs = reinterpret_cast<const Elf64_Shdr*>(base + ehdr->e_shoff);
+	const Elf64_Shdr* symtab = nullptr;
+	for (int i = 0; i < ehdr->e_shnum; ++i) {
+		if (shdrs[i].sh_type == SHT_SYMTAB)
+			symtab = &shdrs[i];
+		else if (shdrs[i].sh_type == SHT_DYNSYM && !symtab)
+			symtab = &shdrs[i];
+	}
+
+	if (symtab) {
+		const auto* syms = reinterpret_cast<const Elf64_Sym*>(base + symtab->sh_offset);
+		const char* strtab = base + shdrs[symtab->sh_link].sh_offset;
+		const size_t count = symtab->sh_size / sizeof(Elf64_Sym);
+
+		for (size_t i = 0; i < count; ++i) {
+			const Elf64_Sym& sym = syms[i];
+
+			if (ELF64_ST_TYPE(sym.st_info) != STT_FUNC || sym.st_shndx == SHN_UNDEF || sym.st_value == 0)
+				continue;
+
+			const uintptr_t begin = bias + sym.st_value;
+			symbols.push_back({ begin, begin + std::max<Elf64_Xword>(sym.st_size, 1), strtab + sym.st_name });
+		}
+	}
+
+	munmap(file, st.st_size);
+	return bias;
+}
+
+	// Builds the sorted symbol table from every executable file mapping in the process
+static void LoadSymbols() {
+	std::ifstream maps{ "/proc/self/maps" };
+	std::string line;
+
+	std::unordered_map<std::string, uintptr_t> loadBases;
+	modules.clear();
+
+	while (std::getline(maps, line)) {
+		unsigned long start = 0, end = 0, offset = 0;
+		char perms[5] = {};
+		int pathPos = 0;
+
+		if (std::sscanf(line.c_str(), "%lx-%lx %4s %lx %*s %*s %n", &start, &end, perms, &offset, &pathPos) < 4)
+			continue;
+
+		const std::string path = line.substr(pathPos);
+		if (path.empty() || path[0] != '/')
+			continue;
+
+		if (offset == 0)
+			loadBases.try_emplace(path, start);
+		if (perms[2] == 'x')
+			modules.push_back(Module{ start, end, offset, path });
+	}
+
+		// A file can have more than one executable mapping, only load its symbols once
+	symbols.clear();
+	std::unordered_map<std::string, uintptr_t> biases;
+	for (Module& module : modules) {
+		auto it = biases.find(module.path);
+
+		if (it == biases.end()) {
+			const auto base = loadBases.find(module.path);
+			const uintptr_t bias = base != loadBases.end() ? LoadElfSymbols(module.path, base->second) : 0;
+			it = biases.emplace(module.path, bias).first;
+		}
+
+		module.bias = it->second;
+	}
+
+	std::sort(symbols.begin(), symbols.end(),
+		[](const SymbolRange& a, const SymbolRange& b) { return a.begin < b.begin; });
+}
+
+	// One open perf event and the ring buffer the kernel writes its samples into
+struct PerfCounter {
+	int fd = -1;
+	SampleSource source;
+	perf_event_mmap_page* meta = nullptr;
+	const char* ring = nullptr;
+	size_t ringSize = 0;
+};
+
+static std::vector<PerfCounter> counters;
+
+	// Preopened in PlatformSpecificInit, so an off-CPU tick is just a few preads
+static int statFd = -1, schedstatFd = -1, syscallFd = -1;
+static uint64_t lastRunNs = 0, lastWaitNs = 0;
+
+	// Data pages per counter, must be a power of two
+constexpr size_t perfDataPages = 8;
+
+static int OpenPerfEvent(uint32_t type, uint64_t config, uint64_t period) {
+	perf_event_attr attr{};
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.sample_period = period;
+	attr.sample_type = PERF_SAMPLE_IP;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return static_cast<int>(syscall(SYS_perf_event_open, &attr, mainThread, -1, -1, PERF_FLAG_FD_CLOEXEC));
+}
+
+	// Copies 'size' bytes starting at ring position 'pos', records can wrap around the end
+static void CopyFromRing(const PerfCounter& counter, uint64_t pos, void* out, size_t size) {
+	const size_t offset = pos & (counter.ringSize - 1);
+	const size_t first = std::min(size, counter.ringSize - offset);
+
+	std::memcpy(out, counter.ring + offset, first);
+	std::memcpy(static_cast<char*>(out) + first, counter.ring, size - first);
+}
+
+std::vector<CounterInfo> PlatformStartCounters(const CounterSettings& settings) {
+	struct Request {
+		bool enabled;
+		SampleSource source;
+		uint64_t config, period;
+		const char* event;
+			// Used when there's no hardware PMU (most VMs). Branch misses have no
+			// software equivalent, cache misses use page faults as the closest thing.
+		int64_t fallbackConfig;
+		uint64_t fallbackPeriod;
+		const char* fallbackEvent;
+	};
+
+	const Request requests[] = {
+			// cpu-clock counts nanoseconds, roughly a cycle each at 1 GHz
+		{ settings.cycles, SampleSource::Cycles, PERF_COUNT_HW_CPU_CYCLES, settings.cyclePeriod, "cycles",
+		  PERF_COUNT_SW_CPU_CLOCK, settings.cyclePeriod, "cpu-clock" },
+		{ settings.cacheMisses, SampleSource::CacheMisses, PERF_COUNT_HW_CACHE_MISSES, settings.cacheMissPeriod, "LLC-misses",
+		  PERF_COUNT_SW_PAGE_FAULTS, 1, "page-faults" },
+		{ settings.branchMisses, SampleSource::BranchMisses, PERF_COUNT_HW_BRANCH_MISSES, settings.branchMissPeriod, "branch-misses",
+		  -1, 0, nullptr },
+	};
+
+	PlatformStopCounters();
+
+	const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	std::vector<CounterInfo> opened;
+
+	for (const Request& request : requests) {
+		if (!request.enabled)
+			continue;
+
+		CounterInfo info{ request.source, request.event, false };
+		int fd = OpenPerfEvent(PERF_TYPE_HARDWARE, request.config, request.period);
+
+		if (fd < 0 && request.fallbackConfig >= 0) {
+			fd = OpenPerfEvent(PERF_TYPE_SOFTWARE, request.fallbackConfig, request.fallbackPeriod);
+			info = CounterInfo{ request.source, request.fallbackEvent, true };
+		}
+
+		if (fd < 0)
+			continue;
+
+			// First page is the metadata page, the rest is the sample ring
+		const size_t mapSize = (1 + perfDataPages) * pageSize;
+		void* map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			continue;
+		}
+
+		PerfCounter counter;
+		counter.fd = fd;
+		counter.source = request.source;
+		counter.meta = static_cast<perf_event_mmap_page*>(map);
+		counter.ring = static_cast<const char*>(map) + pageSize;
+		counter.ringSize = perfDataPages * pageSize;
+		counters.push_back(counter);
+
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		opened.push_back(info);
+	}
+
+	return opened;
+}
+
+void PlatformStopCounters() {
+	const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+	for (PerfCounter& counter : counters) {
+		ioctl(counter.fd, PERF_EVENT_IOC_DISABLE, 0);
+		munmap(counter.meta, (1 + perfDataPages) * pageSize);
+		close(counter.fd);
+	}
+
+	counters.clear();
+}
+
+size_t ReadCounterSamples(Sample* out, size_t max) {
+		// The kernel buffers only carry the IP, so everything read in this pass shares a
+		// timestamp. Good to within the poll interval.
+	const uint64_t tick = internal::Now();
+	size_t count = 0;
+
+	for (PerfCounter& counter : counters) {
+		const uint64_t head = __atomic_load_n(&counter.meta->data_head, __ATOMIC_ACQUIRE);
+		uint64_t tail = counter.meta->data_tail;
+
+		while (tail < head && count < max) {
+			perf_event_header header;
+			CopyFromRing(counter, tail, &header, sizeof(header));
+
+			if (header.type == PERF_RECORD_SAMPLE) {
+				uint64_t ip = 0;
+				CopyFromRing(counter, tail + sizeof(header), &ip, sizeof(ip));
+				out[count++] = Sample{ reinterpret_cast<void*>(ip), tick, counter.source };
+			}
+			else if (header.type == PERF_RECORD_LOST) {
+					// { u64 id; u64 lost; } follows the header
+				uint64_t lost = 0;
+				CopyFromRing(counter, tail + sizeof(header) + sizeof(uint64_t), &lost, sizeof(lost));
+				data->dropped.fetch_add(lost, std::memory_order_relaxed);
+			}
+
+			tail += header.size;
+		}
+
+			// Hands the space back to the kernel
+		__atomic_store_n(&counter.meta->data_tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return count;
+}
+
+std::vector<ModuleInfo> GetModules() {
+	std::vector<ModuleInfo> result;
+	for (const Module& module : modules)
+		result.push_back(ModuleInfo{ module.begin, module.end, module.offset, module.path });
+
+	return result;
+}
+
+	// Starts 'args[0]' with its stdout piped back. No shell is involved, so module paths
+	// with quotes or spaces in them reach the program untouched.
+static FILE* SpawnReader(const std::vector<std::string>& args, pid_t& child) {
+	std::vector<char*> argv;
+	for (const std::string& arg : args)
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	argv.push_back(nullptr);
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) != 0)
+		return nullptr;
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+	const int error = posix_spawn(&child, argv[0], &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[1]);
+
+	if (error != 0) {
+		close(fds[0]);
+		return nullptr;
+	}
+
+	FILE* output = fdopen(fds[0], "r");
+	if (!output) {
+		close(fds[0]);
+		waitpid(child, nullptr, 0);
+	}
+
+	return output;
+}
+
+	// Same approach as the memory debugger, addr2line reads the DWARF line tables for us.
+	// Addresses are grouped by module so each module's tables only get parsed once per batch.
+std::vector<SourceLine> GetSourceLines(const std::vector<void*>& addrs) {
+	std::vector<SourceLine> result(addrs.size());
+	std::unordered_map<const Module*, std::vector<size_t>> byModule;
+
+	for (size_t i = 0; i < addrs.size(); ++i) {
+		const auto a = reinterpret_cast<uintptr_t>(addrs[i]);
+		auto it = std::find_if(modules.begin(), modules.end(),
+			[a](const Module& module) { return a >= module.begin && a < module.end; });
+
+		if (it != modules.end())
+			byModule[&*it].push_back(i);
+	}
+
+	for (const auto& [module, indices] : byModule) {
+		for (size_t first = 0; first < indices.size(); first += addr2lineBatch) {
+			const size_t last = std::min(first + addr2lineBatch, indices.size());
+
+			std::vector<std::string> args{ "/bin/addr2line", "-e", module->path };
+			char addrText[32];
+			for (size_t i = first; i < last; ++i) {
+				std::snprintf(addrText, sizeof(addrText), "0x%zx",
+					reinterpret_cast<uintptr_t>(addrs[indices[i]]) - module->bias);
+				args.emplace_back(addrText);
+			}
+
+			pid_t child;
+			FILE* reader = SpawnReader(args, child);
+			if (!reader)
+				continue;
+
+				// One "file:line" (or "??:0") per address, possibly followed by " (discriminator N)"
+			char output[4096];
+			for (size_t i = first; i < last && std::fgets(output, sizeof(output), reader); ++i) {
+				std::string_view text = output;
+				text = text.substr(0, text.find('\n'));
+				text = text.substr(0, text.rfind(" (discriminator"));
+
+				const size_t colon = text.rfind(':');
+				if (colon == std::string_view::npos || text.starts_with("??"))
+					continue;
+
+				SourceLine& line = result[indices[i]];
+				line.file = text.substr(0, colon);
+				line.line = static_cast<unsigned>(std::strtoul(std::string(text.substr(colon + 1)).c_str(), nullptr, 10));
+			}
+
+			std::fclose(reader);
+			waitpid(child, nullptr, 0);
+		}
+	}
+
+	return result;
+}
+
+	// procfs files can be re-read from offset 0 without reopening them
+static bool ReadProcFile(int fd, char* buf, size_t size) {
+	const ssize_t count = pread(fd, buf, size - 1, 0);
+	if (count <= 0)
+		return false;
+
+	buf[count] = '\0';
+	return true;
+}
+
+Sample SampleThreadState() {
+	Sample sample{ nullptr, internal::Now() };
+	char buf[512];
+
+		// State is the first field after the ')' that closes the thread name
+	if (!ReadProcFile(statFd, buf, sizeof(buf)))
+		return sample;
+
+	const char* nameEnd = std::strrchr(buf, ')');
+	const char state = nameEnd && nameEnd[1] ? nameEnd[2] : '?';
+
+		// Time on the cpu and time waiting in the run queue, both in ns
+	unsigned long long runNs = lastRunNs, waitNs = lastWaitNs;
+	if (ReadProcFile(schedstatFd, buf, sizeof(buf)))
+		std::sscanf(buf, "%llu %llu", &runNs, &waitNs);
+
+	const uint64_t ran = runNs - lastRunNs, waited = waitNs - lastWaitNs;
+	lastRunNs = runNs;
+	lastWaitNs = waitNs;
+
+		// 'R' covers both running and sitting in the run queue, schedstat tells them apart
+	if (state == 'R') {
+		sample.state = waited > ran ? ThreadState::Runnable : ThreadState::Running;
+		sample.rip = GetRip();
+		return sample;
+	}
+
+	sample.state = ThreadState::Blocked;
+
+		// "nr arg1 ... arg6 sp pc" while in a system call, "-1 sp pc" when blocked outside one.
+		// pc is the user space instruction the thread will resume at, i.e. the call site.
+	if (ReadProcFile(syscallFd, buf, sizeof(buf)) && std::strncmp(buf, "running", 7) != 0) {
+		const long nr = std::strtol(buf, nullptr, 10);
+		const char* pc = std::strrchr(buf, ' ');
+
+		sample.waitReason = nr >= 0 && nr < noWaitReason ? static_cast<uint16_t>(nr) : noWaitReason;
+		if (pc)
+			sample.rip = reinterpret_cast<void*>(std::strtoull(pc + 1, nullptr, 16));
+	}
+
+	return sample;
+}
+
+	// Just the system calls a thread usually blocks in
+const char* WaitReasonName(uint16_t reason) {
+	switch (reason) {
+	case SYS_read: return "read";
+	case SYS_write: return "write";
+	case SYS_pread64: return "pread64";
+	case SYS_pwrite64: return "pwrite64";
+	case SYS_readv: return "readv";
+	case SYS_writev: return "writev";
+	case SYS_poll: return "poll";
+	case SYS_ppoll: return "ppoll";
+	case SYS_select: return "select";
+	case SYS_pselect6: return "pselect6";
+	case SYS_epoll_wait: return "epoll_wait";
+	case SYS_epoll_pwait: return "epoll_pwait";
+	case SYS_futex: return "futex";
+	case SYS_nanosleep: return "nanosleep";
+	case SYS_clock_nanosleep: return "clock_nanosleep";
+	case SYS_accept: return "accept";
+	case SYS_accept4: return "accept4";
+	case SYS_connect: return "connect";
+	case SYS_recvfrom: return "recvfrom";
+	case SYS_recvmsg: return "recvmsg";
+	case SYS_sendto: return "sendto";
+	case SYS_sendmsg: return "sendmsg";
+	case SYS_wait4: return "wait4";
+	case SYS_openat: return "openat";
+	case SYS_fsync: return "fsync";
+	case SYS_fdatasync: return "fdatasync";
+	case SYS_flock: return "flock";
+	case SYS_fcntl: return "fcntl";
+	case SYS_ioctl: return "ioctl";
+	case SYS_msync: return "msync";
+	case noWaitReason: return "no syscall";
+	default: return "other syscall";
+	}
+}
+
+	// Must be called from the thread that should be sampled, same as on Windows
+void PlatformSpecificInit() {
+	if (mainThread != 0)
+		return;
+
+	mainThread = static_cast<pid_t>(syscall(SYS_gettid));
+	ripSignal = SIGRTMIN + 1;
+	sem_init(&ripReady, 0, 0);
+
+	const std::string taskDir = "/proc/self/task/" + std::to_string(mainThread) + '/';
+	statFd = open((taskDir + "stat").c_str(), O_RDONLY | O_CLOEXEC);
+	schedstatFd = open((taskDir + "schedstat").c_str(), O_RDONLY | O_CLOEXEC);
+	syscallFd = open((taskDir + "syscall").c_str(), O_RDONLY | O_CLOEXEC);
+
+	struct sigaction action{};
+	action.sa_sigaction = RipHandler;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+
+	if (sigaction(ripSignal, &action, nullptr) != 0) {
+		error
+		return;
+	}
+
+	LoadSymbols();
+}
+
+	// Just cleanup details
+void PlatformSpecificExit() {
+	PlatformStopCounters();
+	signal(ripSignal, SIG_DFL);
+	sem_destroy(&ripReady);
+
+	for (int* fd : { &statFd, &schedstatFd, &syscallFd }) {
+		if (*fd >= 0)
+			close(*fd);
+		*fd = -1;
+	}
+	symbols.clear();
+	symbols.shrink_to_fit();
+	mainThread = 0;
+}
+
+	// Linux can't read another thread's registers without ptrace, so interrupt the main
+	// thread with a signal and have it report where it was.
+void* GetRip() {
+		// Throw away a late post from a sample that previously timed out
+	while (sem_trywait(&ripReady) == 0) {}
+
+	if (syscall(SYS_tgkill, getpid(), mainThread, ripSignal) != 0)
+		return nullptr;
+
+	const auto ns = (std::chrono::steady_clock::now() + ripTimeout).time_since_epoch().count();
+	const timespec deadline{ static_cast<time_t>(ns / 1'000'000'000), static_cast<long>(ns % 1'000'000'000) };
+
+	while (sem_clockwait(&ripReady, CLOCK_MONOTONIC, &deadline) != 0) {
+		if (errno != EINTR)
+			return nullptr;
+	}
+
+	return sampledRip.load(std::memory_order_relaxed);
+}
+
+	// Get name of symbol from an address
+std::string GetSymbolName(void* addr) {
+	const auto a = reinterpret_cast<uintptr_t>(addr);
+
+		// Last symbol that starts at or before the address
+	auto it = std::upper_bound(symbols.begin(), symbols.end(), a,
+		[](uintptr_t value, const SymbolRange& sym) { return value < sym.begin; });
+
+	if (it == symbols.begin() || a >= (--it)->end)
+		return {};
+
+	int status = 0;
+	char* demangled = abi::__cxa_demangle(it->name.c_str(), nullptr, nullptr, &status);
+	if (status != 0)
+		return it->name;
+
+	std::string name = demangled;
+	std::free(demangled);
+	return name;
+}
+
+} // namespace SProfiler
+
+
+// ----- Overhead benchmark -----
+	// Build with SPROFILER_BENCHMARK defined to check GetOverhead() against the slowdown a
+	// workload actually sees, across thread counts and sampling rates.
+#ifdef SPROFILER_BENCHMARK
+#include <cstdio>
+
+namespace {
+	// Enough integer work that the compiler can't fold it away
+uint64_t Churn(uint64_t iterations) {
+	uint64_t x = 0x9E3779B97F4A7C15;
+	for (uint64_t i = 0; i < iterations; ++i) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+	}
+
+	return x;
+}
+
+	// Runs the workload on 'threads' threads (the main thread being one of them) and returns
+	// how long the main thread's share took, since that's the thread being sampled
+double RunWorkload(size_t threads, uint64_t iterations) {
+	std::vector<std::thread> workers;
+	std::atomic_uint64_t sink = 0;
+
+	for (size_t i = 1; i < threads; ++i)
+		workers.emplace_back([&] { sink += Churn(iterations); });
+
+	const auto start = std::chrono::steady_clock::now();
+	sink += Churn(iterations);
+	const auto end = std::chrono::steady_clock::now();
+
+	for (auto& worker : workers)
+		worker.join();
+
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+	// Best of a few runs, the rest is scheduler noise
+template <typename Func>
+double BestOf(Func&& func, int runs = 3) {
+	double best = func();
+	for (int i = 1; i < runs; ++i)
+		best = std::min(best, func());
+
+	return best;
+}
+} // namespace
+
+int main() {
+	constexpr uint64_t iterations = 200'000'000;
+	constexpr size_t threadCounts[] = { 1, 2, 4, 8 };
+	constexpr size_t rates[] = { 1, 2, 5, 10 };
+
+	std::printf("threads  rate/ms  measured%%  reported stall%%  reported cpu%%  capture us\n");
+
+	for (size_t threads : threadCounts) {
+		const double baseline = BestOf([&] { return RunWorkload(threads, iterations); });
+
+		for (size_t rate : rates) {
+			SProfiler::OverheadReport reported;
+
+			const double profiled = BestOf([&] {
+				SProfiler::Init();
+					// Twice as many samples as the run should need so the profiler never stops early
+				SProfiler::Start(static_cast<size_t>(baseline * rate * 2) + 1, rate);
+
+				const double ms = RunWorkload(threads, iterations);
+				reported = SProfiler::GetOverhead();
+
+				SProfiler::Exit();
+				return ms;
+			});
+
+			std::printf("%7zu  %7zu  %9.2f  %15.2f  %13.2f  %10.2f\n", threads, rate,
+				100 * (profiled - baseline) / baseline, reported.mainThreadStallPercent,
+				reported.profilerCpuPercent, reported.captureMicrosPerSample);
+		}
+	}
+}
+#endif